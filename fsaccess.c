@@ -9,6 +9,13 @@
  *						(1) the name of the (special) file that physically represents the disk,
  *						(2) number n1 indicating the total number of blocks in the disk (fsize) and
  *						(3) number n2 representing the total number of i-nodes in the disk.
+ *					followed by options:
+ *						-b  track free blocks in a bitmap instead of the chained free list
+ *						-e  map the blocks of files copied in by extents (start block, number of blocks)
+ *						-d  index the names of new directories by hash
+ *						-l  leave the inode table unwritten, inode blocks are zeroed when first used
+ *						-s <size>  bytes per block, a power of two from 1024 (the default) to 65536
+ *						-L  64 bit file sizes, files may be larger than 4 GB
  *			(b) q  Quit the program by saving all the work
  *			
  *			(c) cpin will create a new file  in the v6 file system and fill the contents of the newly created file with the contents of the externalfile.
@@ -25,6 +32,11 @@
  *			(f) rm will remove the file/directory from the v6 file system
  *					rm will accept 1 argument
  *						(1)	the filepath of the v6 file
+ *			(g) stats prints the buffer cache, inode table, dentry cache, Bloom filter, inode bitmap and hole counters (hits, misses, blocks/inodes written)
+ *			(h) bench [iterations] times the scalar, SSE2 and AVX2 directory block compare kernels
+ *			(i) compactdir [directory path] frees the unused slots and blocks at the end of a directory
+ *			(j) df prints the free data blocks and inodes kept in the extended super block
+ *			(k) load <file> [--mmap] opens an existing file system, --mmap maps the image and the buffer cache points into the mapping
  *  How to run:
  *    Compile using:
  *        cc fsaccess.c -lm -o fsaccess 
@@ -44,21 +56,39 @@
  * 														 supported commands to test
 **/
 
+#define _GNU_SOURCE // copy_file_range
+
 #include<stdio.h>
 #include<unistd.h>
+#include<fcntl.h>
+#include<sys/stat.h>
+#include<sys/mman.h>
+#include<errno.h>
 #include<string.h>
 #include<stdlib.h>
 #include<math.h>
 #include<time.h>
+#include<limits.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include<immintrin.h>
+#define DIR_MATCH_X86 1 // SSE2 and AVX2 directory block compares
+#endif
 
 
 
 /* Toogle status to print/ not print execution steps in the console 1 - print , 0 - don't print*/
 #define DEBUG 0
 
-#define BLOCK_SIZE 1024
+// Block size of the loaded file system, chosen with initfs -s and recorded in the extended super block,
+// all block geometry below is computed from it at run time
+#define BLOCK_SIZE blockSize
+#define DEFAULT_BLOCK_SIZE 1024
+#define MAX_BLOCK_SIZE 65536
 #define INODE_SIZE_BYTES 64
 
+// Number of blocks moved between the host file and the disk per read/write in cpin and cpout
+#define IO_CHUNK_BLOCKS 64
+
 // MACRO function to print if DEBUG is set
 #if DEBUG
     #define DEBUG_LOG printf
@@ -73,13 +103,85 @@
 // Gives the length of the array
 #define len(X)  (int)(sizeof(X)/sizeof(*(X)))
 
-#define NUMBER_OF_INODES_PER_BLOCK  BLOCK_SIZE/INODE_SIZE_BYTES
+#define NUMBER_OF_INODES_PER_BLOCK  (BLOCK_SIZE/INODE_SIZE_BYTES)
 
 #define BLOCK_POSITION(n) (n) * BLOCK_SIZE
 
 // block 0 is left free, block 1 stores the super block, so i nodes start from block 2
 #define INODE_POSITION(n) ((2) * BLOCK_SIZE) + ((n-1) * INODE_SIZE_BYTES) // inode number starts with 1
 
+// block holding the inode and the byte offset of the inode inside that block
+#define INODE_BLOCK(n) (2 + ((n)-1) / NUMBER_OF_INODES_PER_BLOCK)
+#define INODE_OFFSET_IN_BLOCK(n) ((((n)-1) % NUMBER_OF_INODES_PER_BLOCK) * INODE_SIZE_BYTES)
+
+// Number of disk blocks kept in the buffer cache and the number of hash chains used to find them
+#define NBUF 1024
+#define BUFFER_HASH_SIZE 1024
+
+// Extended super block, stored in block 0 which V6 leaves unused
+#define FS_MAGIC 0x36564658 // "XFV6", block 0 of images created before the extended super block is zero
+#define FS_VERSION 2 // version 2 keeps the free block and inode counts in the extended super block
+
+// Optional features, selected by initfs options and recorded in the extended super block
+#define FEATURE_BLOCK_BITMAP 1 // free blocks are tracked in an on-disk bitmap instead of the chained free[] list
+#define FEATURE_EXTENTS 2 // cpin creates extent-mapped files
+#define FEATURE_DIR_INDEX 4 // new directories get a hashed name index
+#define FEATURE_LAZY_INODES 8 // inode blocks are zeroed when first written, not by initfs
+#define FEATURE_LARGE_FILES 16 // file sizes are 64 bits, acttime[] holds the high 32 bits instead of the access time
+
+// Directory entries compared by one call of dirBlockMatch, one bit each of the result
+#define DIR_MATCH_ENTRIES 32
+
+// initfs writes zeros in chunks of this many blocks
+#define ZERO_CHUNK_BLOCKS 256
+
+// Extent-mapped files (inode flag bit 11): addr[0..9] hold INODE_EXTENTS (start, length) pairs,
+// addr[10] the first block of a chain of extent blocks for the extents that follow
+#define INODE_EXTENTS 5
+#define EXTENTS_PER_BLOCK ((BLOCK_SIZE/sizeof(int) - 2) / 2)
+
+// Files of up to INLINE_DATA_SIZE bytes (inode flag bit 13) keep their contents in addr[] instead of a data block
+#define INLINE_DATA_SIZE (int)sizeof(((inode_t*)0)->addr)
+
+// Hashed directories (inode flag bit 9): slot DIR_INDEX_SLOT of the first directory block
+// points to the index root, a table of DIR_INDEX_BUCKETS chains of index blocks, neighbouring buckets share a block
+#define DIR_INDEX_MAGIC 0x58444948 // "HIDX"
+#define DIR_INDEX_SLOT 2 // after . and ..
+#define DIR_INDEX_BUCKETS (BLOCK_SIZE/sizeof(int))
+#define DIR_INDEX_ENTRIES_PER_BLOCK ((BLOCK_SIZE/sizeof(int) - 2) / 2)
+
+// free-block bitmap geometry, bit n of the bitmap is set when block n is in use
+#define BITS_PER_BITMAP_BLOCK (BLOCK_SIZE * 8)
+#define BITMAP_WORD_BITS 64
+
+// inode bitmap summaries, free inodes are counted per group of this many inodes
+#define INODES_PER_GROUP 4096
+
+// Number of inodes kept in the incore inode table
+#define NINODE 256
+#define INODE_HASH_SIZE 256
+
+// Number of (directory, name) lookups kept in the dentry cache
+#define NDENTRY 4096
+#define DENTRY_HASH_SIZE 4096
+
+// Number of directories with a Bloom filter of their names, bits per name and hash functions per name
+#define NDIRINFO 64
+#define BLOOM_BITS_PER_NAME 10
+#define BLOOM_HASHES 4
+#define BLOOM_MIN_BITS 1024
+
+// A directory is compacted when an entry is deleted and more than this percentage of its slots are holes, 0 disables it
+#define DIR_COMPACT_HOLE_PERCENT 50
+
+// Unlinked files (inode flag bit 10) keep their blocks until they are reclaimed, at most this many blocks after each command.
+// Files of up to this many blocks are freed by rm directly
+#define ORPHAN_SLICE_BLOCKS 4096
+
+// Buffer flags
+#define B_VALID 1 // buffer holds the contents of the block
+#define B_DIRTY 2 // buffer was modified and has to be written back to the disk
+
 
 
 // Super Block Struct
@@ -96,18 +198,35 @@ struct superblock_t {
     unsigned short time[2]; /* 4 bytes */
 }; // 1023 bytes 
 
+// Extended Super Block struct
+struct extsuperblock_t {
+	unsigned int magic; /* FS_MAGIC */
+	unsigned int version; /* on-disk format version */
+	unsigned int features; /* FEATURE_* flags */
+	unsigned int bitmapStart; /* first block of the free-block bitmap */
+	unsigned int bitmapBlocks; /* number of bitmap blocks */
+	unsigned int allocRotor; /* bitmap allocation continues searching from this block */
+	unsigned int inodeBlocksInit; /* with FEATURE_LAZY_INODES, inode blocks after this many were never written and hold free inodes */
+	unsigned int inodeRotor; /* refills of the i-list continue searching the inode bitmap from this inode */
+	unsigned int freeBlocks; /* free data blocks, kept by the block allocators */
+	unsigned int freeInodes; /* free inodes, kept by get_free_inode and add_free_inode */
+	unsigned int orphanHead; /* first unlinked file whose blocks are not freed yet, the next one is kept in its modtime[] */
+	unsigned int orphans; /* number of files on the orphan list */
+	unsigned int blockSize; /* bytes per block, 0 for images created before it was recorded (DEFAULT_BLOCK_SIZE) */
+};
+
 // inode struct
 typedef struct  {
 	unsigned short flags; /* 2 byte */
 	char nlinks; /* 1 byte */
 	char uid; /* 1 byte */
 	char gid; /* 1 byte */
-	unsigned short size0; /* 2 bytes */ //To support a file size of 4 GB
+	unsigned short size0; /* 2 bytes */ //To support a file size of 4 GB, see inodeSize for larger files
 	unsigned short size1; /* 2 bytes */ 
 	/* It will use triple level chaining at addr[10] for large files 
 			and single chaining for small files. so a 256 * 256 * 256 * 1024 = 16 GB  */
 	unsigned int addr[11]; /* 44 bytes */
-	unsigned short acttime[2]; /* 4 bytes */
+	unsigned short acttime[2]; /* 4 bytes */ // high 32 bits of the size with FEATURE_LARGE_FILES
 	unsigned short modtime[2]; /* 4 bytes */
 } inode_t; // 61 bytes
 
@@ -125,20 +244,105 @@ typedef struct{
 } directoryitem_t; // 32 bytes
 
 
-// Single Indirection block
+// Extent block, overflow of the extents kept in the inode
+#pragma pack(1) // exact fitting no extra padding
+typedef struct {
+	unsigned int next; /* next extent block, 0 for the last one */
+	unsigned int count; /* extents used in this block */
+	unsigned int extents[][2]; /* EXTENTS_PER_BLOCK (start block, number of blocks) */
+} extentblock_t; // one block
+
+// Directory slot pointing to the index root of a hashed directory
 #pragma pack(1) // exact fitting no extra padding
 typedef struct {
-	unsigned int blockNumbers[BLOCK_SIZE/sizeof(int)];
-} singleIndirectblock_t; //1024 bytes
+	unsigned int inode; /* always 0, directory scans skip the slot */
+	unsigned int zero; /* empty name */
+	unsigned int magic; /* DIR_INDEX_MAGIC */
+	unsigned int root; /* block number of the index root */
+	char unused[16];
+} dirindexslot_t; // 32 bytes, same as directoryitem_t
+
+// Index block, one link of a bucket chain of a hashed directory
+#pragma pack(1) // exact fitting no extra padding
+typedef struct {
+	unsigned int next; /* next index block of the bucket, 0 for the last one */
+	unsigned int count; /* entries used in this block */
+	unsigned int entries[][2]; /* DIR_INDEX_ENTRIES_PER_BLOCK (name hash, directory slot) */
+} dirindexblock_t; // one block
 
 //Directory content
 typedef struct{
 	unsigned int inode; 
 	char name[28];   
 	unsigned short isDirectory;
-	unsigned int fileSize;
+	unsigned long long fileSize;
 } directoryContent;
 
+// Buffer cache entry, holds one disk block
+typedef struct buf {
+	unsigned int blkno; // block number held by the buffer
+	short flags;  // B_VALID, B_DIRTY
+	short refcount; // number of users holding the buffer, held buffers are never evicted
+	struct buf *hashnext; // next buffer on the same hash chain
+	struct buf *lrunext; // LRU list, lruHead.lrunext is the least recently used buffer
+	struct buf *lruprev;
+	char *data; // block contents
+} buf_t;
+
+// Incore inode, an inode held in memory by iget until it is evicted or flushed
+typedef struct {
+	inode_t inode; // must be the first member, iget hands out a pointer to it
+	int number; // inode number, 0 if the entry is unused
+	short refcount; // number of users holding the inode, held inodes are never evicted
+	short dirty; // modified since it was read, written back by iflush or on eviction
+	unsigned long lastUse; // for least recently used eviction
+	int hashnext; // index of the next entry on the same hash chain, -1 at the end
+} incoreinode_t;
+
+// Block map cursor of an open file, see bmap
+typedef struct {
+	int inode_number;
+	inode_t *inode; // held with iget while the cursor is open
+	buf_t *level[3]; // pinned indirection blocks: first, second and third (last) level
+	int levelDirty[3]; // pinned block was changed by bmapAppend, written back when it is unpinned
+	/* extent-mapped files, level[2] pins the extent block of the cached extent */
+	int extentIndex; // cached extent, -1 if none
+	unsigned int extentLogical; // first logical block of the cached extent
+	unsigned int extentStart, extentLength;
+	unsigned int extentBase; // index of the first extent of the pinned extent block, counted after the inode extents
+	int extentTail; // index of the last extent of the file, -2 if not known yet
+} blockmap_t;
+
+// Dentry cache entry, the result of looking up a name in a directory
+typedef struct {
+	int parent; // inode of the directory, 0 if the entry is unused
+	int child; // inode of the name, 0 if the name does not exist in the directory
+	char name[28];
+	short referenced; // looked up since the clock hand last passed, gets a second chance
+	int hashnext; // index of the next entry on the same hash chain, -1 at the end
+} dentry_t;
+
+// In-memory information about a directory, a Bloom filter of the names in it
+typedef struct {
+	int inode_number; // directory, 0 if the entry is unused
+	unsigned long long *bloom; // filter bits, a name whose bits are not all set is not in the directory
+	unsigned int bloomBits; // size of the filter, a power of two
+	unsigned int names; // names added to the filter
+	unsigned int deletes; // names deleted since the filter was built, their bits stay set
+	unsigned int slots; // size of the directory in entries
+	unsigned int *holes; // free slots, reused before the directory grows
+	unsigned int nholes, holesSize;
+	unsigned long lastUse; // for least recently used reuse of the entry
+} dirinfo_t;
+
+// Directory scan, streams the entries of a directory without reading the inodes they point to
+typedef struct {
+	blockmap_t map;
+	buf_t *bp; // directory block holding the next entry, NULL before the first one
+	int offset; // byte offset of the next entry in the directory
+	int size; // directory size in bytes
+} dirscan_t;
+
 /* Globals Constants */
 char delimiter[] = " ";
 
@@ -149,34 +353,179 @@ void initfs(char *args);
 void add_to_free_list(int blockNumber);
 void create_new_directory(int datablockNumber,int parentinode,int newinode);
 unsigned int get_free_block();
+unsigned int get_free_blocks(unsigned int want,unsigned int *got);
 unsigned int get_free_inode();
+void add_free_inode(int inumber);
+void inodeBitmapInit();
+void inodeBitmapBuild();
+void inodeBitmapDrop();
+void inodeBitmapSet(int inode_number,int used);
+unsigned int inodeBitmapScan(unsigned int from,unsigned int to);
 void print_free_inode_list();
 void print_free_block_list();
 void make_dir(char *args);
 void load(char *args);
-void makeLargefile(int inode_number);
+int makeLargefile(int inode_number);
 void add_directoryEntry_to_parentDir(char *name,int parentinode,int newinode);
 void rm(char *args);
 void deleteDir(int inode_number);
 void deleteFile(int inode_number);
+void orphanFile(int inode_number);
+void reclaimOrphans(unsigned int budget);
 void deleteDirectoryEntry(int parent_inode_number,int inode_number);
 directoryContent* getDirectoryContents(int* noOfitems,int inode_number);
+int dirOpen(dirscan_t *scan,int inode_number);
+directoryitem_t* dirNext(dirscan_t *scan);
+void dirClose(dirscan_t *scan);
+directoryitem_t* dirMatch(dirscan_t *scan,unsigned char *pattern,int first,int length);
+void dirNamePattern(char *fileName,unsigned char *pattern,int *length);
+unsigned int dirBlockMatchScalar(char *block,int entries,unsigned char *pattern,int first,int length);
+void bench(char *args);
+#ifdef DIR_MATCH_X86
+unsigned int dirBlockMatchSSE2(char *block,int entries,unsigned char *pattern,int first,int length);
+unsigned int dirBlockMatchAVX2(char *block,int entries,unsigned char *pattern,int first,int length);
+int zeroTestSSE2(char *data,int size);
+int zeroTestAVX2(char *data,int size);
+#endif
+int zeroTestScalar(char *data,int size);
+int blockIsZero(char *data,int size);
+int dcacheLookup(int parent_inode_number,char *fileName,int *inode_number);
+void dcacheEnter(int parent_inode_number,char *fileName,int inode_number);
+void dcachePurgeDir(int parent_inode_number);
+void dcachePurge();
+int dirBloomMayContain(int inode_number,char *fileName);
+void dirInfoAdd(int inode_number,char *fileName,unsigned int slot);
+int dirInfoDelete(int inode_number,unsigned int slot);
+int dirHoleTake(int inode_number);
+int compactDirectory(int inode_number);
+void compactdir(char *args);
+void bmapTruncate(blockmap_t *map,int oldBlocks,int newBlocks);
+void dirIndexClear(unsigned int root);
+void dirInfoDrop(int inode_number);
+void dirInfoPurge();
 int fileExists(char *fileName, int parent_inode_number);
 void cpin(char *args);
 void cpout(char *args);
 int searchFileInFileSystem(char *path, int *parent_inode_number,char *fileName);
 void listDir();
 void changeParentDir(char *args);
-void addDataBlockToInode(int inode_number,int blockNumber);
-int getBlockToRead(int offset,int inode_number);
+void addDataBlockToInode(int inode_number,int logicalBlockNumber,int blockNumber);
+int getBlockToRead(unsigned long long offset,int inode_number);
+void bmapOpen(blockmap_t *map,int inode_number);
+unsigned int bmap(blockmap_t *map,int logicalBlockNumber);
+void bmapClose(blockmap_t *map);
+int bmapAppend(blockmap_t *map,int logicalBlockNumber,int blockNumber);
+int readFully(int filedes,char *buffer,int size);
+void writeBlockRuns(unsigned int *blocks,int noOfBlocks,char *buffer,int size);
+int copyBlockRunOut(int efd,int blockNumber,off_t size,off_t outOffset);
+buf_t* getblk(unsigned int blockNumber);
+void clrbuf(buf_t *bp);
+buf_t* bread(unsigned int blockNumber);
+void brelse(buf_t *bp);
+void bdwrite(buf_t *bp);
+void bflush();
+void bflushBlocks(unsigned int blockNumber,int noOfBlocks);
+void binval(unsigned int blockNumber);
+void bpurge();
+void readBlock(unsigned int blockNumber,void *buffer,int size);
+void writeBlock(unsigned int blockNumber,void *buffer,int size);
+void zeroBlocks(unsigned int blockNumber,unsigned int count);
+void freeChainInit(unsigned int firstDataBlock,unsigned int lastDataBlock);
+void readInode(int inode_number,inode_t *inode);
+void writeInode(int inode_number,inode_t *inode);
+unsigned long long inodeSize(inode_t *inode);
+void setInodeSize(inode_t *inode,unsigned long long size);
+unsigned long long maxFileSize();
+void saveFileSystem();
+void countFree();
+void df();
+int bitmapInit(unsigned int firstDataBlock);
+void bitmapLoad();
+void bitmapSave();
+unsigned int bitmapAlloc(unsigned int want,unsigned int *got);
+void bitmapFree(unsigned int blockNumber);
+void bitmapFreeRun(unsigned int blockNumber,unsigned int count);
+void free_blocks(unsigned int blockNumber,unsigned int count);
+unsigned int bmapExtent(blockmap_t *map,unsigned int logicalBlockNumber);
+int bmapExtentAppend(blockmap_t *map,unsigned int blockNumber);
+void deleteExtents(inode_t *fileInode);
+unsigned int dirHash(char *name);
+unsigned int dirIndexRoot(int inode_number);
+void dirIndexCreate(directoryitem_t *entries);
+unsigned int dirIndexAttach(int inode_number);
+void dirIndexAdd(int inode_number,char *name,unsigned int slot);
+int dirIndexInsert(unsigned int root,char *name,unsigned int slot);
+void dirIndexRemove(unsigned int root,char *name,unsigned int slot);
+int dirIndexLookup(int inode_number,unsigned int root,char *fileName);
+void dirIndexDrop(int inode_number,unsigned int root);
+inode_t* iget(int inode_number);
+void iput(inode_t *inode);
+void imarkdirty(inode_t *inode);
+void iflush();
+void ipurge();
+void mapSync();
+void mapRelease();
+
+/* Directory block compare, the fastest kernel the processor supports, chosen on first use */
+unsigned int (*dirBlockMatch)(char *block,int entries,unsigned char *pattern,int first,int length) = NULL;
+
+/* All-zero test of a block read by cpin, chosen on first use like dirBlockMatch */
+int (*zeroTest)(char *data,int size) = NULL;
 
 /* Global variables */
+int blockSize = DEFAULT_BLOCK_SIZE;
 struct superblock_t sb;
+struct extsuperblock_t esb;
 int fd = 0;
 int numberOfInodes;
 int currentDirectoryInode = 1;
 char *currentDirectoryName;
 
+/* Buffer cache */
+buf_t *bufhash[BUFFER_HASH_SIZE];
+buf_t lruHead; // sentinel of the circular LRU list
+int nbuf = 0;
+unsigned long cacheHits = 0, cacheMisses = 0, cacheWrites = 0;
+
+/* Disk image mapped by load --mmap, NULL when blocks are read and written with pread/pwrite */
+char *mapBase = NULL;
+size_t mapSize = 0;
+unsigned int mapDirtyLow = UINT_MAX, mapDirtyHigh = 0; // range of blocks modified through the mapping since the last msync
+unsigned long mapSyncs = 0;
+
+/* Zero blocks cpin left as holes instead of allocating them */
+unsigned long holeBlocks = 0;
+
+/* Free-block bitmap, the whole bitmap is kept in memory while the file system is loaded */
+unsigned long long *blockBitmap = NULL;
+unsigned int *bitmapGroupFree = NULL; // free blocks per bitmap block, groups without free blocks are skipped
+char *bitmapGroupDirty = NULL; // bitmap block changed since the last save
+
+/* Inode bitmap, kept in memory only, built from the inode table on the first refill of the i-list */
+unsigned long long *inodeBitmap = NULL; // bit n-1 is set when inode n is in use or handed out
+unsigned int *inodeGroupFree = NULL; // free inodes per group of INODES_PER_GROUP, full groups are skipped
+int inodeBitmapBuilt = 0;
+unsigned long inodeBitmapBuilds = 0;
+
+/* Incore inode table */
+incoreinode_t itable[NINODE];
+int ihash[INODE_HASH_SIZE];
+int itableInitialized = 0;
+unsigned long inodeClock = 0;
+unsigned long inodeHits = 0, inodeMisses = 0, inodeWrites = 0;
+
+/* Dentry cache */
+dentry_t dcache[NDENTRY];
+int dhash[DENTRY_HASH_SIZE];
+int dcacheInitialized = 0;
+int dcacheHand = 0; // clock hand, next entry considered for reuse
+unsigned long dentryHits = 0, dentryMisses = 0;
+
+/* Directory information */
+dirinfo_t dirinfo[NDIRINFO];
+unsigned long dirinfoClock = 0;
+unsigned long bloomNegatives = 0, bloomFalsePositives = 0, bloomBuilds = 0;
+
 /***********************************************************************
  The main function:
     1) Lists the list of commands supported by the program
@@ -188,14 +537,29 @@ int main()
 {
 
 	/* Array to store the list of commands */
-	const char *a[7]; 
-	a[0] = "initfs";
-	a[1] = "load";
-	a[2] = "cpin";
-	a[3] = "cpout";
-	a[4] = "mkdir";
-	a[5] = "rm";
-	a[6] = "q";
+	const char *a[] = {
+		"initfs",
+		"load [--mmap]  --mmap maps the image instead of reading and writing its blocks",
+		"cpin",
+		"cpout",
+		"mkdir",
+		"rm",
+		"q",
+		"stats  prints the cache counters",
+		"bench [iterations]  times the directory block compare kernels",
+		"compactdir [directory]  frees the unused slots at the end of a directory",
+		"df  prints the free blocks and inodes",
+	};
+
+	/* Options of initfs, after the file name, the number of blocks and the number of inodes */
+	const char *initfsOptions[] = {
+		"-b  track free blocks in a bitmap",
+		"-e  map the blocks of copied files by extents",
+		"-d  index the names of new directories by hash",
+		"-l  zero inode blocks when first used instead of in initfs",
+		"-s <size>  bytes per block, a power of two from 1024 to 65536",
+		"-L  64 bit file sizes, files larger than 4 GB",
+	};
 	
 	currentDirectoryName =  malloc(100);
 
@@ -210,6 +574,9 @@ int main()
 
 	for(i=0;i<len(a);i++)
 		printf("\t %d. %s\n",i+1,a[i]);
+	printf("\n\t initfs options:\n");
+	for(i=0;i<len(initfsOptions);i++)
+		printf("\t\t %s\n",initfsOptions[i]);
 
 	while(1)
 	{	
@@ -237,6 +604,540 @@ int fileSystemLoaded()
 	return 1;
 }
 
+/***********************************************************************
+ Buffer cache:
+	All metadata blocks (inodes, directories, indirection blocks and the
+	free list) are read and written through the cache. Blocks stay in memory
+	until they are evicted (least recently used first) or the cache is flushed
+	on q/load, modified blocks are written back only then.
+	Data blocks of regular files bypass the cache (see writeBlockRuns and
+	copyBlockRunOut), those paths invalidate/flush any cached copy first.
+	After load --mmap the data of a buffer points into the mapped image
+	instead of a copy: bread reads nothing and writing a buffer back only
+	widens the range that saveFileSystem passes to msync. pread/pwrite on
+	the image go through the same page cache, so the paths around the
+	cache stay coherent with the mapping.
+***********************************************************************/
+
+// Unlinks the buffer from the LRU list
+void lruRemove(buf_t *bp)
+{
+	bp->lruprev->lrunext = bp->lrunext;
+	bp->lrunext->lruprev = bp->lruprev;
+}
+
+// Links the buffer at the most recently used end of the LRU list
+void lruAppend(buf_t *bp)
+{
+	bp->lrunext = &lruHead;
+	bp->lruprev = lruHead.lruprev;
+	lruHead.lruprev->lrunext = bp;
+	lruHead.lruprev = bp;
+}
+
+// Removes the buffer from its hash chain
+void hashRemove(buf_t *bp)
+{
+	buf_t **link = &bufhash[bp->blkno % BUFFER_HASH_SIZE];
+	while(*link && *link != bp)
+		link = &(*link)->hashnext;
+	if(*link)
+		*link = bp->hashnext;
+	bp->hashnext = NULL;
+}
+
+// Returns the cached buffer of the block, NULL if the block is not in the cache
+buf_t* bfind(unsigned int blockNumber)
+{
+	buf_t *bp = bufhash[blockNumber % BUFFER_HASH_SIZE];
+	while(bp && !(bp->blkno == blockNumber && (bp->flags & B_VALID)))
+		bp = bp->hashnext;
+	return bp;
+}
+
+// Writes the buffer to the disk if it was modified
+void bwriteout(buf_t *bp)
+{
+	if(bp->flags & B_DIRTY)
+	{
+		if(mapBase == NULL)
+			pwrite(fd,bp->data,BLOCK_SIZE,BLOCK_POSITION((off_t)bp->blkno));
+		else
+		{
+			// the block is already in the mapping, msync writes it
+			if(bp->blkno < mapDirtyLow)
+				mapDirtyLow = bp->blkno;
+			if(bp->blkno > mapDirtyHigh)
+				mapDirtyHigh = bp->blkno;
+		}
+		bp->flags &= ~B_DIRTY;
+		cacheWrites++;
+	}
+}
+
+/* Returns a held buffer for the block without reading it from the disk,
+   used when the caller overwrites the whole block */
+buf_t* getblk(unsigned int blockNumber)
+{
+	buf_t *bp;
+
+	if(lruHead.lrunext == NULL) // first use, empty circular list
+		lruHead.lrunext = lruHead.lruprev = &lruHead;
+
+	bp = bfind(blockNumber);
+	if(bp == NULL)
+	{
+		// take the least recently used buffer nobody is holding
+		for(bp = lruHead.lrunext; bp != &lruHead && bp->refcount > 0; bp = bp->lrunext);
+
+		if(nbuf < NBUF || bp == &lruHead) // cache not full yet, or every buffer is held
+		{
+			bp = malloc(sizeof(buf_t));
+			bp->data = mapBase == NULL ? malloc(BLOCK_SIZE) : NULL;
+			bp->flags = 0;
+			bp->refcount = 0;
+			bp->hashnext = NULL;
+			lruAppend(bp);
+			nbuf++;
+		}
+		else
+		{
+			bwriteout(bp);
+			if(bp->flags & B_VALID)
+				hashRemove(bp);
+		}
+
+		bp->blkno = blockNumber;
+		bp->flags = B_VALID;
+		bp->hashnext = bufhash[blockNumber % BUFFER_HASH_SIZE];
+		bufhash[blockNumber % BUFFER_HASH_SIZE] = bp;
+		bp->refcount = 0;
+		if(mapBase == NULL)
+			memset(bp->data,0,BLOCK_SIZE);
+		else // the block itself, bread has nothing to read
+			bp->data = mapBase + BLOCK_POSITION((off_t)blockNumber);
+	}
+
+	lruRemove(bp);
+	lruAppend(bp);
+	bp->refcount++;
+	return bp;
+}
+
+/* Returns a held buffer with the contents of the block */
+buf_t* bread(unsigned int blockNumber)
+{
+	buf_t *bp = bfind(blockNumber);
+	if(bp)
+	{
+		cacheHits++;
+		return getblk(blockNumber);
+	}
+
+	cacheMisses++;
+	bp = getblk(blockNumber);
+	if(mapBase == NULL)
+		pread(fd,bp->data,BLOCK_SIZE,BLOCK_POSITION((off_t)blockNumber));
+	return bp;
+}
+
+/* Releases a held buffer */
+void brelse(buf_t *bp)
+{
+	bp->refcount--;
+}
+
+/* Marks the buffer as modified and releases it, the block is written back on flush or eviction */
+void bdwrite(buf_t *bp)
+{
+	bp->flags |= B_DIRTY;
+	brelse(bp);
+}
+
+// orders buffers by block number so flushing writes the disk sequentially
+int compareBuffers(const void *a,const void *b)
+{
+	unsigned int x = (*(buf_t**)a)->blkno, y = (*(buf_t**)b)->blkno;
+	return (x > y) - (x < y);
+}
+
+/* Writes all modified buffers to the disk */
+void bflush()
+{
+	buf_t *bp;
+	int count = 0;
+
+	if(nbuf == 0)
+		return;
+
+	buf_t **dirty = malloc(sizeof(buf_t*) * nbuf);
+	for(bp = lruHead.lrunext; bp != &lruHead; bp = bp->lrunext)
+		if((bp->flags & B_VALID) && (bp->flags & B_DIRTY))
+			dirty[count++] = bp;
+
+	qsort(dirty,count,sizeof(buf_t*),compareBuffers);
+	int i;
+	for(i=0;i<count;i++)
+		bwriteout(dirty[i]);
+	free(dirty);
+}
+
+/* Writes back the modified cached copies of the given range of blocks,
+   called before the blocks are read around the cache */
+void bflushBlocks(unsigned int blockNumber,int noOfBlocks)
+{
+	int i;
+	for(i=0;i<noOfBlocks;i++)
+	{
+		buf_t *bp = bfind(blockNumber + i);
+		if(bp)
+			bwriteout(bp);
+	}
+}
+
+/* Drops the cached copy of the block (modified or not),
+   called before the block is written around the cache */
+void binval(unsigned int blockNumber)
+{
+	buf_t *bp = bfind(blockNumber);
+	if(bp && bp->refcount == 0)
+	{
+		hashRemove(bp);
+		bp->flags = 0;
+		// reuse it first
+		lruRemove(bp);
+		bp->lrunext = lruHead.lrunext;
+		bp->lruprev = &lruHead;
+		lruHead.lrunext->lruprev = bp;
+		lruHead.lrunext = bp;
+	}
+}
+
+/* Drops every cached block and frees the buffers, used when a different file system
+   (possibly of another block size) is loaded. Modified buffers have to be flushed before */
+void bpurge()
+{
+	buf_t *bp, *next;
+	if(nbuf == 0)
+		return;
+	for(bp = lruHead.lrunext; bp != &lruHead; bp = next)
+	{
+		next = bp->lrunext;
+		if(mapBase == NULL)
+			free(bp->data);
+		free(bp);
+	}
+	memset(bufhash,0,sizeof(bufhash));
+	lruHead.lrunext = lruHead.lruprev = &lruHead;
+	nbuf = 0;
+}
+
+/* Writes the blocks modified through the mapping of load --mmap to the disk */
+void mapSync()
+{
+	if(mapBase == NULL || mapDirtyLow > mapDirtyHigh)
+		return;
+	long pageSize = sysconf(_SC_PAGESIZE);
+	off_t start = BLOCK_POSITION((off_t)mapDirtyLow) / pageSize * pageSize; // msync takes a page aligned address
+	off_t end = BLOCK_POSITION((off_t)mapDirtyHigh + 1);
+	msync(mapBase + start,end - start,MS_SYNC);
+	mapSyncs++;
+	mapDirtyLow = UINT_MAX;
+	mapDirtyHigh = 0;
+}
+
+/* Unmaps the disk image, the buffer cache has to be purged before since its buffers point into the mapping */
+void mapRelease()
+{
+	if(mapBase == NULL)
+		return;
+	mapSync();
+	munmap(mapBase,mapSize);
+	mapBase = NULL;
+	mapSize = 0;
+}
+
+/* Copies the first size bytes of the block into buffer */
+void readBlock(unsigned int blockNumber,void *buffer,int size)
+{
+	buf_t *bp = bread(blockNumber);
+	memcpy(buffer,bp->data,size);
+	brelse(bp);
+}
+
+/* Zero fills the buffer, a block taken from the free list may still be cached with its old contents */
+void clrbuf(buf_t *bp)
+{
+	memset(bp->data,0,BLOCK_SIZE);
+}
+
+/* Writes zeros to the blocks directly, the blocks must not be in the buffer cache */
+void zeroBlocks(unsigned int blockNumber,unsigned int count)
+{
+	char *zeros = calloc(ZERO_CHUNK_BLOCKS,BLOCK_SIZE);
+	while(count > 0)
+	{
+		unsigned int n = count < ZERO_CHUNK_BLOCKS ? count : ZERO_CHUNK_BLOCKS;
+		pwrite(fd,zeros,n * BLOCK_SIZE,BLOCK_POSITION((off_t)blockNumber));
+		blockNumber += n;
+		count -= n;
+	}
+	free(zeros);
+}
+
+/* Replaces the block with size bytes of buffer followed by zeros */
+void writeBlock(unsigned int blockNumber,void *buffer,int size)
+{
+	buf_t *bp = getblk(blockNumber);
+	clrbuf(bp);
+	memcpy(bp->data,buffer,size);
+	bdwrite(bp);
+}
+
+/***********************************************************************
+ Incore inode table:
+	Like the V6 inode table, iget returns the inode held in memory and
+	iput releases it. Changes are made in place and marked with imarkdirty,
+	the inode is copied back into its inode block once at the end of the
+	command (iflush) or when the entry is reused for another inode.
+***********************************************************************/
+
+// Returns the table entry of the inode, NULL if the inode is not in the table
+incoreinode_t* ifind(int inode_number)
+{
+	int k;
+	if(!itableInitialized)
+		return NULL;
+	for(k = ihash[inode_number % INODE_HASH_SIZE]; k != -1; k = itable[k].hashnext)
+		if(itable[k].number == inode_number)
+			return &itable[k];
+	return NULL;
+}
+
+// Copies the inode from its inode block
+void readInodeFromBlock(int inode_number,inode_t *inode)
+{
+	// inode blocks never written by a lazily initialized file system hold free inodes
+	if((esb.features & FEATURE_LAZY_INODES) && (unsigned int)(INODE_BLOCK(inode_number) - 2) >= esb.inodeBlocksInit)
+	{
+		memset(inode,0,sizeof(inode_t));
+		return;
+	}
+	buf_t *bp = bread(INODE_BLOCK(inode_number));
+	memcpy(inode,bp->data + INODE_OFFSET_IN_BLOCK(inode_number),sizeof(inode_t));
+	brelse(bp);
+}
+
+// Copies the inode into its inode block
+void writeInodeToBlock(int inode_number,inode_t *inode)
+{
+	// zero the inode blocks up to the one of the inode the first time they are written
+	while((esb.features & FEATURE_LAZY_INODES) && (unsigned int)(INODE_BLOCK(inode_number) - 2) >= esb.inodeBlocksInit)
+	{
+		buf_t *newbp = getblk(2 + esb.inodeBlocksInit++);
+		clrbuf(newbp);
+		bdwrite(newbp);
+		sb.fmod = 1;
+	}
+	buf_t *bp = bread(INODE_BLOCK(inode_number));
+	memcpy(bp->data + INODE_OFFSET_IN_BLOCK(inode_number),inode,sizeof(inode_t));
+	bdwrite(bp);
+}
+
+// Writes a modified incore inode back to its inode block
+void iwriteout(incoreinode_t *ip)
+{
+	if(ip->dirty)
+	{
+		writeInodeToBlock(ip->number,&ip->inode);
+		ip->dirty = 0;
+		inodeWrites++;
+	}
+}
+
+// Removes the entry from its hash chain
+void iunhash(incoreinode_t *ip)
+{
+	int k = ip - itable;
+	int *link = &ihash[ip->number % INODE_HASH_SIZE];
+	while(*link != -1 && *link != k)
+		link = &itable[*link].hashnext;
+	if(*link == k)
+		*link = ip->hashnext;
+}
+
+/* Returns the incore copy of the inode and holds it, must be released with iput */
+inode_t* iget(int inode_number)
+{
+	int k;
+	incoreinode_t *ip;
+
+	if(!itableInitialized)
+	{
+		for(k=0;k<INODE_HASH_SIZE;k++)
+			ihash[k] = -1;
+		itableInitialized = 1;
+	}
+
+	ip = ifind(inode_number);
+	if(ip)
+		inodeHits++;
+	else
+	{
+		inodeMisses++;
+
+		// take an unused entry, or the least recently used one nobody is holding
+		ip = NULL;
+		for(k=0;k<NINODE;k++)
+		{
+			if(itable[k].number == 0)
+			{
+				ip = &itable[k];
+				break;
+			}
+			if(itable[k].refcount == 0 && (ip == NULL || itable[k].lastUse < ip->lastUse))
+				ip = &itable[k];
+		}
+		if(ip == NULL)
+		{
+			printf("Inode table overflow!");
+			exit(1);
+		}
+		if(ip->number != 0)
+		{
+			iwriteout(ip);
+			iunhash(ip);
+		}
+
+		ip->number = inode_number;
+		ip->refcount = 0;
+		ip->dirty = 0;
+		readInodeFromBlock(inode_number,&ip->inode);
+		ip->hashnext = ihash[inode_number % INODE_HASH_SIZE];
+		ihash[inode_number % INODE_HASH_SIZE] = ip - itable;
+	}
+
+	ip->refcount++;
+	ip->lastUse = ++inodeClock;
+	return &ip->inode;
+}
+
+/* Releases an inode returned by iget */
+void iput(inode_t *inode)
+{
+	((incoreinode_t*)inode)->refcount--;
+}
+
+/* Marks an inode returned by iget as modified */
+void imarkdirty(inode_t *inode)
+{
+	((incoreinode_t*)inode)->dirty = 1;
+}
+
+/* Writes all modified incore inodes to their inode blocks */
+void iflush()
+{
+	int k;
+	for(k=0;k<NINODE;k++)
+		if(itable[k].number != 0)
+			iwriteout(&itable[k]);
+}
+
+/* Forgets all incore inodes, used when a different file system is loaded.
+   Modified inodes have to be flushed before */
+void ipurge()
+{
+	int k;
+	for(k=0;k<NINODE;k++)
+	{
+		itable[k].number = 0;
+		itable[k].refcount = 0;
+		itable[k].dirty = 0;
+	}
+	for(k=0;k<INODE_HASH_SIZE;k++)
+		ihash[k] = -1;
+	itableInitialized = 1;
+}
+
+/* Copies the inode, from the incore table if it is held there, otherwise from its inode block */
+void readInode(int inode_number,inode_t *inode)
+{
+	incoreinode_t *ip = ifind(inode_number);
+	if(ip)
+		memcpy(inode,&ip->inode,sizeof(inode_t));
+	else
+		readInodeFromBlock(inode_number,inode);
+}
+
+/* Replaces the inode, in the incore table if it is held there, otherwise in its inode block */
+void writeInode(int inode_number,inode_t *inode)
+{
+	incoreinode_t *ip = ifind(inode_number);
+	if(ip)
+	{
+		memcpy(&ip->inode,inode,sizeof(inode_t));
+		ip->dirty = 1;
+	}
+	else
+		writeInodeToBlock(inode_number,inode);
+}
+
+/* Returns the size of the file in bytes, size0 and size1 hold the low 32 bits */
+unsigned long long inodeSize(inode_t *inode)
+{
+	unsigned long long size = (unsigned int)inode->size0 << 16 | inode->size1;
+	if(esb.features & FEATURE_LARGE_FILES)
+		size |= (unsigned long long)((unsigned int)inode->acttime[0] << 16 | inode->acttime[1]) << 32;
+	return size;
+}
+
+/* Sets the size of the file, the caller marks the inode dirty */
+void setInodeSize(inode_t *inode,unsigned long long size)
+{
+	inode->size0 = (size >> 16) & (256*256 -1);
+	inode->size1 = size & (256*256 -1);
+	if(esb.features & FEATURE_LARGE_FILES)
+	{
+		inode->acttime[0] = (size >> 48) & (256*256 -1);
+		inode->acttime[1] = (size >> 32) & (256*256 -1);
+	}
+}
+
+/* Largest file cpin can create: the blocks its map reaches (logical block numbers are ints),
+   and 4 GB - 1 bytes unless the file system was created with initfs -L */
+unsigned long long maxFileSize()
+{
+	unsigned long long n = NUMBER_OF_BLOCKS_PER_INDIRECTION;
+	unsigned long long blocks = (len(((inode_t*)0)->addr) - 1) * n + n * n * n; // single indirection blocks and the triple indirection
+	if((esb.features & FEATURE_EXTENTS) || blocks > INT_MAX)
+		blocks = INT_MAX;
+	unsigned long long size = blocks * BLOCK_SIZE;
+	if(!(esb.features & FEATURE_LARGE_FILES) && size > 0xffffffffULL)
+		size = 0xffffffffULL;
+	return size;
+}
+
+/* Writes the cached blocks and the super block to the disk */
+void saveFileSystem()
+{
+	iflush();
+	bflush();
+	if(esb.features & FEATURE_BLOCK_BITMAP)
+		bitmapSave();
+	if(sb.fmod)
+	{
+		sb.fmod = 0;
+		// Save super block
+		lseek(fd, BLOCK_POSITION(1), SEEK_SET); 
+		write(fd,&sb,sizeof(sb));	
+
+		// Save extended super block
+		lseek(fd, 0, SEEK_SET); 
+		write(fd,&esb,sizeof(esb));	
+	}
+	mapSync();
+}
+
 /*******************************************************************************
  processCommand function:
     1) Reads the first part of the command and call the corresponding function 
@@ -253,17 +1154,32 @@ int processCommand(char cmd[100])
 		initfs(cPtr);
 	else if(strcmp(cPtr,"load") == 0)
 		load(cPtr);
-	else if(strcmp(cPtr,"q")==0) // Saves the super block and returns 0
+	else if(strcmp(cPtr,"q")==0) // Saves the cached blocks and the super block and returns 0
 	{
-			if(sb.fmod)
-			{
-				sb.fmod = 0;
-				// Save super block and close the file
-				lseek(fd, BLOCK_POSITION(1), SEEK_SET); 
-				write(fd,&sb,sizeof(sb));	
-			}
+			if(fd!=0)
+				saveFileSystem();
 			return 0;
 	}	
+	else if (strcmp(cPtr,"stats") == 0)
+	{
+		printf("Buffer cache: %d buffers, %lu hits, %lu misses, %lu blocks written",nbuf,cacheHits,cacheMisses,cacheWrites);
+		if(mapBase != NULL)
+			printf(", image mapped (%lu msync calls)",mapSyncs);
+		printf("\nInode table: %lu hits, %lu misses, %lu inodes written back",inodeHits,inodeMisses,inodeWrites);
+		printf("\nDentry cache: %lu hits, %lu misses",dentryHits,dentryMisses);
+		printf("\nDirectory Bloom filters: %lu built, %lu lookups answered without a scan, %lu false positives",bloomBuilds,bloomNegatives,bloomFalsePositives);
+		printf("\nInode bitmap: %s, built %lu times, i-list refills continue at inode %u",inodeBitmapBuilt ? "in memory" : "not built",inodeBitmapBuilds,esb.inodeRotor);
+		printf("\nSparse files: %lu zero blocks left as holes by cpin",holeBlocks);
+	}
+	else if (strcmp(cPtr,"df") == 0)
+	{
+		if(fileSystemLoaded())
+			df();
+	}
+	else if (strcmp(cPtr,"bench") == 0)
+	{
+		bench(cPtr);
+	}
 	else if (strcmp(cPtr,"cpin") == 0)
 	{
 		if(fileSystemLoaded())
@@ -289,6 +1205,11 @@ int processCommand(char cmd[100])
 		if(fileSystemLoaded())
 			listDir();
 	}
+	else if (strcmp(cPtr,"compactdir") == 0)
+	{
+		if(fileSystemLoaded())
+			compactdir(cPtr);
+	}
 	else if (strcmp(cPtr,"cd") == 0)
 	{
 		if(fileSystemLoaded())
@@ -296,6 +1217,13 @@ int processCommand(char cmd[100])
 	}
 	else 
 		printf("Invalid command!");
+
+	// free a slice of the blocks of deleted files, then write the inodes changed by the command back to their (cached) inode blocks
+	if(fd!=0)
+	{
+		reclaimOrphans(ORPHAN_SLICE_BLOCKS);
+		iflush();
+	}
 	return 1;
 }
 
@@ -326,9 +1254,10 @@ void initfs(char *args){
 		printf("Arguments missing!");
 		return;
 	}
-	sb.fsize = atoi(args);
+	// the file system in use stays loaded until every argument is checked and the new file is open
+	int fsize = atoi(args);
 
-	if(sb.fsize < 4){
+	if(fsize < 4){
 		printf("Total number of blocks cannot be less than 4");
 		return;
 	}
@@ -339,56 +1268,137 @@ void initfs(char *args){
 		return;
 	}
 
-	numberOfInodes = atoi(args);
-	
-	// Calculate isize 
-	sb.isize = ceil((double)numberOfInodes/(double)(NUMBER_OF_INODES_PER_BLOCK));
+	int inodes = atoi(args);
+
+	// Optional arguments
+	//		-b  track free blocks in a bitmap instead of the chained free list
+	//		-e  map the blocks of files copied in by extents
+	//		-d  index the names of new directories by hash
+	//		-l  leave the inode table unwritten, inode blocks are zeroed when first used
+	//		-s <size>  bytes per block, a power of two from 1024 (the default) to 65536
+	//		-L  64 bit file sizes, files may be larger than 4 GB
+	unsigned int features = 0;
+	int newBlockSize = DEFAULT_BLOCK_SIZE;
+	while((args = strtok(NULL,delimiter)) != NULL)
+	{
+		if(strcmp(args,"-s") == 0)
+		{
+			args = strtok(NULL,delimiter);
+			newBlockSize = args != NULL ? atoi(args) : 0;
+			if(newBlockSize < DEFAULT_BLOCK_SIZE || newBlockSize > MAX_BLOCK_SIZE || (newBlockSize & (newBlockSize - 1)) != 0)
+			{
+				printf("Block size must be a power of two from %d to %d",DEFAULT_BLOCK_SIZE,MAX_BLOCK_SIZE);
+				return;
+			}
+		}
+		else if(strcmp(args,"-b") == 0)
+			features |= FEATURE_BLOCK_BITMAP;
+		else if(strcmp(args,"-e") == 0)
+			features |= FEATURE_EXTENTS;
+		else if(strcmp(args,"-d") == 0)
+			features |= FEATURE_DIR_INDEX;
+		else if(strcmp(args,"-l") == 0)
+			features |= FEATURE_LAZY_INODES;
+		else if(strcmp(args,"-L") == 0)
+			features |= FEATURE_LARGE_FILES;
+		else
+		{
+			printf("Unknown option %s",args);
+			return;
+		}
+	}
+
+	// the super blocks, the inode blocks and the bitmap must leave at least one data block for the root directory
+	int isize = ceil((double)inodes/(double)(newBlockSize/INODE_SIZE_BYTES));
+	int bitmapBlocks = (features & FEATURE_BLOCK_BITMAP) ? (fsize + newBlockSize * 8 - 1) / (newBlockSize * 8) : 0;
+	if(inodes < 1 || 2 + isize + bitmapBlocks >= fsize)
+	{
+		printf("Total number of blocks is too small for the inodes%s",(features & FEATURE_BLOCK_BITMAP) ? " and the bitmap" : "");
+		return;
+	}
+
 	// Open File
-	fd = open(fileName,2);
+	int newfd = open(fileName,2);
 	
-	if(fd <=0)
+	if(newfd <=0)
 	{
 		printf("file %s does not exist. Create using touch command and try again",fileName);
 		return;
 	}
 
+	// Save the file system in use and forget its cached blocks
+	if(fd!=0)
+	{
+		saveFileSystem();
+		ipurge();
+		bpurge();
+		dcachePurge();
+		dirInfoPurge();
+		inodeBitmapDrop();
+		mapRelease();
+		close(fd);
+	}
+	fd = newfd;
+	blockSize = newBlockSize;
+	sb.fsize = fsize;
+	
+	// isize as computed above, the inodes that fill the last inode block are usable too (as after a load)
+	sb.isize = isize;
+	numberOfInodes = sb.isize * NUMBER_OF_INODES_PER_BLOCK;
+
+	// Extend the file to the size of the disk, the blocks added read as zeros without being written
+	struct stat fileStat;
+	fstat(fd,&fileStat);
+	off_t oldFileSize = fileStat.st_size;
+	if(oldFileSize < BLOCK_POSITION((off_t)sb.fsize))
+		ftruncate(fd,BLOCK_POSITION((off_t)sb.fsize));
+
 	DEBUG_LOG(("\n Creating super block..."));
 	// Create super block
 	
 	sb.nfree = 0;
-	DEBUG_LOG(("\n\t Add free data blocks to free[]..."));
+
+	// Create extended super block
+	memset(&esb,0,sizeof(esb));
+	esb.magic = FS_MAGIC;
+	esb.version = FS_VERSION;
+	esb.features = features;
+	esb.blockSize = blockSize;
 
 	int first_D_Node_BlockNumber;
 	int last_D_Node_BlockNumber;
 
 	first_D_Node_BlockNumber = (2) + sb.isize;
-	last_D_Node_BlockNumber = first_D_Node_BlockNumber + sb.fsize - 1 - 2 - sb.isize;
-	
-	// Adding block zero to free list this will be returned as the last free block, we can check for disk full case
-	add_to_free_list(0); 
-	
-	/*Add free nodes to the free[]
-	* Add the blocks in the reverse order
-	* Root directory will be written on the first data block
-	*/
-	for(i=0;i<sb.fsize - 2 - sb.isize;i++) 
-	{	
-		add_to_free_list(last_D_Node_BlockNumber - i);
+	last_D_Node_BlockNumber = sb.fsize - 1;
+
+	if(esb.features & FEATURE_BLOCK_BITMAP)
+	{
+		DEBUG_LOG(("\n\t Creating free-block bitmap..."));
+		// The bitmap follows the inode blocks, data blocks follow the bitmap
+		esb.bitmapStart = first_D_Node_BlockNumber;
+		esb.bitmapBlocks = bitmapBlocks;
+		first_D_Node_BlockNumber += esb.bitmapBlocks;
+		bitmapInit(first_D_Node_BlockNumber);
+	}
+	else
+	{
+		DEBUG_LOG(("\n\t Add free data blocks to free[]..."));
+		/*Add free nodes to the free[]
+		* Block zero goes first, it will be returned as the last free block, we can check for disk full case
+		* Add the blocks in the reverse order
+		* Root directory will be written on the first data block
+		*/
+		freeChainInit(first_D_Node_BlockNumber,last_D_Node_BlockNumber);
 	}
 
 	DEBUG_LOG(("\n\t Setting unallocated flag to all the inodes"));
-	int j=0;
-	//Set unallocated flags to all inodes and write to File
-	for(i=1;i<=numberOfInodes;i++)
+	//Set unallocated flags to all inodes: zero the inode blocks, those past the old end of the file already read as zeros
+	if(esb.features & FEATURE_LAZY_INODES)
+		esb.inodeBlocksInit = 0;
+	else if(oldFileSize > BLOCK_POSITION(2))
 	{
-			inode_t tempinode;
-			tempinode.flags = 0;
-			for(j=0;j<len(tempinode.addr);j++)
-				tempinode.addr[j] = 0;
-			tempinode.size0 = 0;
-			tempinode.size1 = 0;
-			lseek(fd,INODE_POSITION(i),SEEK_SET);
-			write(fd,&tempinode,sizeof(tempinode));
+		unsigned int oldBlocks = (oldFileSize + BLOCK_SIZE - 1) / BLOCK_SIZE - 2;
+		zeroBlocks(2,oldBlocks < sb.isize ? oldBlocks : sb.isize);
 	}
 
 	sb.ninode = 0;
@@ -402,6 +1412,11 @@ void initfs(char *args){
 			sb.ninode++;
 	}
 
+	// every inode but the root is free, the next refill of the i-list starts after the inodes put in it
+	inodeBitmapInit();
+	esb.inodeRotor = sb.ninode + 2;
+	esb.freeInodes = numberOfInodes - 1;
+
 	
 	DEBUG_LOG(("\n\t Creating Root directory"));
 	// create directory in first datablock,
@@ -433,6 +1448,10 @@ void initfs(char *args){
 	// Seek to the current position from the begining of the disk
 	lseek(fd, BLOCK_POSITION(1), SEEK_SET);
 	write(fd,&sb,sizeof(sb));
+
+	// Write extended super block to block 0
+	lseek(fd, 0, SEEK_SET);
+	write(fd,&esb,sizeof(esb));
 	
 	if(DEBUG)
 	{
@@ -451,6 +1470,11 @@ void initfs(char *args){
 ***********************************************************************/
 void add_to_free_list(int blockNumber)
 {
+	if(esb.features & FEATURE_BLOCK_BITMAP)
+	{
+		bitmapFree(blockNumber);
+		return;
+	}
 	
 	if(sb.nfree < len(sb.free))
 	{
@@ -476,11 +1500,46 @@ void add_to_free_list(int blockNumber)
 		sb.nfree++;	
 
 		//write to data block
-		lseek(fd,BLOCK_POSITION(blockNumber),SEEK_SET);
-		write(fd,&freeBlock,sizeof(freeBlock));
+		writeBlock(blockNumber,&freeBlock,sizeof(freeBlock));
 		
 	}
 
+	esb.freeBlocks++;
+	sb.fmod = 1;
+}
+
+/***********************************************************************
+ freeChainInit function:
+    Builds the free list of a new file system, the same list as adding
+	block zero and then the data blocks from the last one down with
+	add_to_free_list, but the free-chain blocks are computed and written
+	directly: each 150th block added holds the 150 blocks added before it.
+***********************************************************************/
+void freeChainInit(unsigned int firstDataBlock,unsigned int lastDataBlock)
+{
+	// entry j of the list: block zero, then lastDataBlock, lastDataBlock - 1, ...
+	long long count = (long long)lastDataBlock - firstDataBlock + 2;
+	long long j;
+	int i;
+	char *block = calloc(1,BLOCK_SIZE); // on the heap, a block may be 64 KB
+	firstfreeblock_t *freeBlock = (firstfreeblock_t*)block;
+
+	if(count < 1)
+		count = 1;
+	freeBlock->nfree = len(sb.free);
+	for(j = len(sb.free); j < count; j += len(sb.free))
+	{
+		for(i=0;i<len(sb.free);i++)
+			freeBlock->free[i] = (j - len(sb.free) + i == 0) ? 0 : lastDataBlock - (j - len(sb.free) + i - 1);
+		pwrite(fd,block,BLOCK_SIZE,BLOCK_POSITION((off_t)(lastDataBlock - (j - 1))));
+	}
+	free(block);
+
+	// the entries after the last free-chain block stay in the super block
+	sb.nfree = 0;
+	for(j -= len(sb.free); j < count; j++)
+		sb.free[sb.nfree++] = (j == 0) ? 0 : lastDataBlock - (j - 1);
+	esb.freeBlocks = count - 1; // every entry but block zero
 	sb.fmod = 1;
 }
 
@@ -494,6 +1553,14 @@ void add_to_free_list(int blockNumber)
 unsigned int get_free_block()
 {
 	int newblock;
+	if(esb.freeBlocks == 0 && esb.orphanHead != 0) // the blocks of deleted files are needed now
+		reclaimOrphans(~0u);
+	if(esb.features & FEATURE_BLOCK_BITMAP)
+	{
+		unsigned int got;
+		return bitmapAlloc(1,&got);
+	}
+
 	sb.nfree--;
 	if(sb.nfree!=0)
 	{
@@ -508,8 +1575,7 @@ unsigned int get_free_block()
 			int i;
 
 			firstfreeblock_t freeBlock;
-			lseek(fd,BLOCK_POSITION(newblock),SEEK_SET);
-			read(fd,&freeBlock,sizeof(freeBlock));
+			readBlock(newblock,&freeBlock,sizeof(freeBlock));
 			
 			
 			sb.nfree = freeBlock.nfree;
@@ -524,9 +1590,282 @@ unsigned int get_free_block()
 			DEBUG_LOG("\nNo more blocks to allocate!");
 		}
 	}
+	if(newblock != 0)
+		esb.freeBlocks--;
 	sb.fmod = 1;
 	return newblock; 
 }
+
+/***********************************************************************
+ get_free_blocks function:
+    1) Allocates a run of physically contiguous free blocks, up to want blocks
+	2) Returns the first block of the run and its length in got, 0 if no
+	   block is free
+	3) The bitmap is searched for a run of the wanted length, the chained
+	   free list hands out blocks while the next one on the list is adjacent
+	   to the previous one
+***********************************************************************/
+unsigned int get_free_blocks(unsigned int want,unsigned int *got)
+{
+	if(esb.freeBlocks == 0 && esb.orphanHead != 0)
+		reclaimOrphans(~0u);
+	if(esb.features & FEATURE_BLOCK_BITMAP)
+		return bitmapAlloc(want,got);
+
+	unsigned int first = get_free_block();
+	*got = 0;
+	if(first == 0)
+		return 0;
+	*got = 1;
+
+	// the next block handed out by get_free_block is free[nfree-1]
+	while(*got < want && sb.nfree > 0 && sb.free[sb.nfree - 1] == first + *got)
+	{
+		get_free_block();
+		(*got)++;
+	}
+	return first;
+}
+
+/***********************************************************************
+ Free-block bitmap (initfs -b):
+	One bit per block, set when the block is in use. The bitmap is read
+	into memory on load and scanned 64 bits at a time, words without a
+	free bit are skipped with a single compare and bitmap blocks without
+	a free block (bitmapGroupFree) are skipped entirely. Allocation is
+	next-fit from esb.allocRotor so consecutive allocations are adjacent.
+	Changed bitmap blocks are written back on save.
+***********************************************************************/
+
+// Allocates the in-memory bitmap and its summaries for the current file system
+void bitmapAllocate()
+{
+	free(blockBitmap);
+	free(bitmapGroupFree);
+	free(bitmapGroupDirty);
+	blockBitmap = malloc(esb.bitmapBlocks * BLOCK_SIZE);
+	bitmapGroupFree = calloc(esb.bitmapBlocks,sizeof(unsigned int));
+	bitmapGroupDirty = calloc(esb.bitmapBlocks,1);
+}
+
+// Returns 1 if the block is in use
+int bitmapTest(unsigned int blockNumber)
+{
+	return (blockBitmap[blockNumber / BITMAP_WORD_BITS] >> (blockNumber % BITMAP_WORD_BITS)) & 1;
+}
+
+// Marks the block as used or free and updates the summary of its bitmap block
+void bitmapSet(unsigned int blockNumber,int used)
+{
+	unsigned long long bit = 1ULL << (blockNumber % BITMAP_WORD_BITS);
+	unsigned int group = blockNumber / BITS_PER_BITMAP_BLOCK;
+	if(used)
+	{
+		blockBitmap[blockNumber / BITMAP_WORD_BITS] |= bit;
+		bitmapGroupFree[group]--;
+	}
+	else
+	{
+		blockBitmap[blockNumber / BITMAP_WORD_BITS] &= ~bit;
+		bitmapGroupFree[group]++;
+	}
+	bitmapGroupDirty[group] = 1;
+}
+
+/* Creates the bitmap of a new file system, blocks before firstDataBlock are in use */
+int bitmapInit(unsigned int firstDataBlock)
+{
+	unsigned int i;
+	bitmapAllocate();
+
+	// mark every bit as used, then free the data blocks
+	memset(blockBitmap,0xff,esb.bitmapBlocks * BLOCK_SIZE);
+	bitmapFreeRun(firstDataBlock,sb.fsize - firstDataBlock);
+	for(i=0;i<esb.bitmapBlocks;i++)
+		bitmapGroupDirty[i] = 1;
+
+	esb.allocRotor = firstDataBlock;
+	return 1;
+}
+
+/* Reads the bitmap of the loaded file system and counts the free blocks of every bitmap block, a word at a time */
+void bitmapLoad()
+{
+	unsigned int i;
+	unsigned int words = (sb.fsize + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS;
+	bitmapAllocate();
+	pread(fd,blockBitmap,esb.bitmapBlocks * BLOCK_SIZE,BLOCK_POSITION((off_t)esb.bitmapStart));
+	for(i=0;i<words;i++)
+	{
+		unsigned long long freeBits = ~blockBitmap[i];
+		if(i == words - 1 && sb.fsize % BITMAP_WORD_BITS != 0) // bits past the end of the disk
+			freeBits &= (1ULL << (sb.fsize % BITMAP_WORD_BITS)) - 1;
+		bitmapGroupFree[i / (BITS_PER_BITMAP_BLOCK / BITMAP_WORD_BITS)] += __builtin_popcountll(freeBits);
+	}
+}
+
+/* Writes the changed bitmap blocks */
+void bitmapSave()
+{
+	unsigned int i;
+	for(i=0;i<esb.bitmapBlocks;i++)
+	{
+		if(bitmapGroupDirty[i])
+		{
+			pwrite(fd,(char*)blockBitmap + i * BLOCK_SIZE,BLOCK_SIZE,BLOCK_POSITION((off_t)(esb.bitmapStart + i)));
+			bitmapGroupDirty[i] = 0;
+		}
+	}
+}
+
+// Returns the length of the free run starting at the block, at most max blocks and not past limit
+unsigned int bitmapRunLength(unsigned int start,unsigned int max,unsigned int limit)
+{
+	unsigned int position = start, length = 0;
+	while(length < max && position < limit)
+	{
+		unsigned long long word = blockBitmap[position / BITMAP_WORD_BITS] >> (position % BITMAP_WORD_BITS);
+		unsigned int step;
+		if(word == 0) // rest of the word is free
+			step = BITMAP_WORD_BITS - position % BITMAP_WORD_BITS;
+		else
+			step = __builtin_ctzll(word); // free bits before the next used block
+		if(step == 0)
+			break;
+		if(step > max - length)
+			step = max - length;
+		if(step > limit - position)
+			step = limit - position;
+		position += step;
+		length += step;
+	}
+	return length;
+}
+
+/* Searches [from, to) for a free run of want blocks. Returns 1 when found, otherwise
+   bestStart/bestLength hold the longest run seen */
+int bitmapScan(unsigned int from,unsigned int to,unsigned int want,unsigned int *bestStart,unsigned int *bestLength)
+{
+	unsigned int position = from;
+	while(position < to)
+	{
+		unsigned int group = position / BITS_PER_BITMAP_BLOCK;
+		if(bitmapGroupFree[group] == 0) // no free block in this bitmap block
+		{
+			position = (group + 1) * BITS_PER_BITMAP_BLOCK;
+			continue;
+		}
+
+		// ignore the bits below position in its word
+		unsigned long long word = blockBitmap[position / BITMAP_WORD_BITS] | ((1ULL << (position % BITMAP_WORD_BITS)) - 1);
+		if(word == ~0ULL)
+		{
+			position = (position / BITMAP_WORD_BITS + 1) * BITMAP_WORD_BITS;
+			continue;
+		}
+
+		unsigned int start = (position / BITMAP_WORD_BITS) * BITMAP_WORD_BITS + __builtin_ctzll(~word);
+		if(start >= to)
+			break;
+		unsigned int length = bitmapRunLength(start,want,to);
+		if(length > *bestLength)
+		{
+			*bestStart = start;
+			*bestLength = length;
+		}
+		if(length >= want)
+			return 1;
+		position = start + length;
+	}
+	return 0;
+}
+
+/* Allocates a run of contiguous free blocks, the first run of want blocks after the rotor,
+   or the longest run found if there is none that long. Returns the first block and the length
+   of the run in got, 0 if the disk is full */
+unsigned int bitmapAlloc(unsigned int want,unsigned int *got)
+{
+	unsigned int bestStart = 0, bestLength = 0, i;
+	unsigned int firstDataBlock = esb.bitmapStart + esb.bitmapBlocks;
+	unsigned int rotor = esb.allocRotor;
+
+	if(rotor < firstDataBlock || rotor >= sb.fsize)
+		rotor = firstDataBlock;
+
+	// search from the rotor to the end, then wrap around
+	if(!bitmapScan(rotor,sb.fsize,want,&bestStart,&bestLength))
+		bitmapScan(firstDataBlock,rotor,want,&bestStart,&bestLength);
+
+	*got = bestLength;
+	if(bestLength == 0)
+	{
+		DEBUG_LOG("\nNo more blocks to allocate!");
+		return 0;
+	}
+
+	for(i=0;i<bestLength;i++)
+		bitmapSet(bestStart + i,1);
+	esb.allocRotor = bestStart + bestLength;
+	esb.freeBlocks -= bestLength;
+	sb.fmod = 1;
+	return bestStart;
+}
+
+/* Marks the block as free */
+void bitmapFree(unsigned int blockNumber)
+{
+	unsigned int firstDataBlock = esb.bitmapStart + esb.bitmapBlocks;
+	if(blockNumber < firstDataBlock || blockNumber >= sb.fsize || !bitmapTest(blockNumber))
+		return; // not a data block or already free
+	bitmapSet(blockNumber,0);
+	esb.freeBlocks++;
+	sb.fmod = 1;
+}
+
+/* Marks a run of blocks as free, a 64 bit word at a time */
+void bitmapFreeRun(unsigned int blockNumber,unsigned int count)
+{
+	unsigned int firstDataBlock = esb.bitmapStart + esb.bitmapBlocks;
+	unsigned int end = blockNumber + count;
+	if(blockNumber < firstDataBlock)
+		blockNumber = firstDataBlock;
+	if(end > sb.fsize)
+		end = sb.fsize;
+
+	while(blockNumber < end)
+	{
+		unsigned int bits = BITMAP_WORD_BITS - blockNumber % BITMAP_WORD_BITS;
+		if(bits > end - blockNumber)
+			bits = end - blockNumber;
+		unsigned long long mask = (bits == BITMAP_WORD_BITS ? ~0ULL : ((1ULL << bits) - 1)) << (blockNumber % BITMAP_WORD_BITS);
+		unsigned long long *word = &blockBitmap[blockNumber / BITMAP_WORD_BITS];
+		unsigned int group = blockNumber / BITS_PER_BITMAP_BLOCK;
+
+		// blocks already free are not counted again
+		bitmapGroupFree[group] += __builtin_popcountll(*word & mask);
+		esb.freeBlocks += __builtin_popcountll(*word & mask);
+		bitmapGroupDirty[group] = 1;
+		*word &= ~mask;
+		blockNumber += bits;
+	}
+	sb.fmod = 1;
+}
+
+/***********************************************************************
+ free_blocks function:
+    Returns a run of contiguous blocks to the free list or the bitmap
+***********************************************************************/
+void free_blocks(unsigned int blockNumber,unsigned int count)
+{
+	if(esb.features & FEATURE_BLOCK_BITMAP)
+	{
+		bitmapFreeRun(blockNumber,count);
+		return;
+	}
+	// pushed from the last block down, get_free_block hands the run out again in ascending order
+	while(count-- > 0)
+		add_to_free_list(blockNumber + count);
+}
 /***********************************************************************
  create_new_directory function:
     1) Writes . and .. entries to the data block of the directory
@@ -534,22 +1873,29 @@ unsigned int get_free_block()
 ***********************************************************************/
 void create_new_directory(int blockNumber,int parentinode,int newinode)
 {
+	dcachePurgeDir(newinode); // lookups cached while the inode was an older directory
+	dirInfoDrop(newinode);
 	DEBUG_LOG(("\n\t\t Creating directory in data block"));
 	//write the directory to data block
-	lseek(fd,BLOCK_POSITION(blockNumber),SEEK_SET);
+	buf_t *bp = getblk(blockNumber);
+	clrbuf(bp);
+	directoryitem_t *entries = (directoryitem_t*)bp->data;
 	directoryitem_t dir;
-	dir.inode = newinode;
-	strcpy(dir.name,".");
+	entries[0].inode = newinode;
+	strcpy(entries[0].name,".");
 
 	DEBUG_LOG(("\n\t\t writing directory entry (..) to data block"));
-	write(fd,&dir,sizeof(dir));
 	
 	directoryitem_t parentDir;
-	dir.inode = parentinode;
-	strcpy(dir.name,"..");
+	entries[1].inode = parentinode;
+	strcpy(entries[1].name,"..");
+
+	// hashed directory, the third slot is kept for the index root
+	if(esb.features & FEATURE_DIR_INDEX)
+		dirIndexCreate(entries);
 	
 	DEBUG_LOG(("\n\t\t writing directory entry (.) to the same data block"));
-	write(fd,&dir,sizeof(parentDir));
+	bdwrite(bp);
 
 	DEBUG_LOG(("\n\t\t Creating new inode for the directory"));
 	//Add the directory info to the inode
@@ -570,9 +1916,13 @@ void create_new_directory(int blockNumber,int parentinode,int newinode)
 	inode.gid = 0;
 	
 	int totSizeOfDir = (int)(sizeof(dir) + sizeof(parentDir));
+	if(esb.features & FEATURE_DIR_INDEX)
+	{
+		inode.flags = inode.flags | (1 << 9); // hashed directory
+		totSizeOfDir += sizeof(dirindexslot_t);
+	}
     
-	inode.size0 = totSizeOfDir >> 16;
-	inode.size1 = totSizeOfDir & (256*256 -1);
+	setInodeSize(&inode,totSizeOfDir);
 
 	int j;
 	for(j=0;j<len(inode.addr);j++)
@@ -583,8 +1933,11 @@ void create_new_directory(int blockNumber,int parentinode,int newinode)
 	time_t sec;
 	sec = time(NULL);
 
-	inode.acttime[0] = sec >> 16;
-	inode.acttime[1] = sec & (256*256 -1); 
+	if(!(esb.features & FEATURE_LARGE_FILES)) // acttime[] holds the high bits of the size
+	{
+		inode.acttime[0] = sec >> 16;
+		inode.acttime[1] = sec & (256*256 -1); 
+	}
 
 	inode.modtime[0] = sec >> 16;
 	inode.modtime[1] = sec & (256 * 256 -1); 
@@ -592,8 +1945,7 @@ void create_new_directory(int blockNumber,int parentinode,int newinode)
 	DEBUG_LOG(("\n\t\t Writing new inode to file"));
 	//Write the directory inode to file
 
-	lseek(fd,INODE_POSITION(newinode),SEEK_SET);
-	write(fd,&inode,sizeof(inode));
+	writeInode(newinode,&inode);
 }
 
 /* Function that add the inode entry to parent directory
@@ -605,7 +1957,7 @@ void add_directoryEntry_to_parentDir(char *name,int parentinode,int newinode)
 {
 	short isAllocated = 0;
 	short isDirectory = 0;
-	inode_t parent_inode;
+	inode_t *parent_inode;
 	
 	//Create Directory Entry
 	directoryitem_t dir;
@@ -613,166 +1965,1494 @@ void add_directoryEntry_to_parentDir(char *name,int parentinode,int newinode)
 	dir.inode = newinode;
 
 	//read parent inode
-	lseek(fd,INODE_POSITION(parentinode),SEEK_SET);
-	read(fd,&parent_inode,sizeof(parent_inode));
+	parent_inode = iget(parentinode);
 
 	//Check isAllocated
-	isAllocated = (parent_inode.flags >> 15); // 1st bit
+	isAllocated = (parent_inode->flags >> 15); // 1st bit
 
 	//Check isDirectory
-	isDirectory = ((parent_inode.flags & (1 << 14)) >> 14); // 2nd bit
+	isDirectory = ((parent_inode->flags & (1 << 14)) >> 14); // 2nd bit
 
 	if(!(isAllocated & isDirectory))
 	{
 		printf("Invalid Operation: Not a directory");
+		iput(parent_inode);
 		return;
 	}
 
-	int dirSize = parent_inode.size0 << 16 | parent_inode.size1;
-	int offset = dirSize % BLOCK_SIZE;
+	int dirSize = inodeSize(parent_inode);
+	buf_t *bp;
+
+	// reuse the slot of a deleted entry
+	int slot = dirHoleTake(parentinode);
+	if(slot >= 0 && slot * (int)sizeof(dir) < dirSize)
+	{
+		bp = bread(getBlockToRead(slot * sizeof(dir),parentinode));
+		directoryitem_t *hole = (directoryitem_t*)(bp->data + slot * sizeof(dir) % BLOCK_SIZE);
+		if(hole->inode == 0)
+		{
+			memcpy(hole,&dir,sizeof(dir));
+			bdwrite(bp);
+			dcacheEnter(parentinode,dir.name,newinode);
+			dirInfoAdd(parentinode,dir.name,slot);
+			dirIndexAdd(parentinode,dir.name,slot);
+			iput(parent_inode);
+			return;
+		}
+		brelse(bp);
+	}
 
+	int offset = dirSize % BLOCK_SIZE;
 	int blockNumber = getBlockToRead(dirSize,parentinode);
 
 	if(blockNumber == 0) //empty block, no space in the datablocks of current inode
 	{
 		blockNumber = get_free_block();
 		if(blockNumber)
-			addDataBlockToInode(parentinode,blockNumber); // Add new block to the inode
+			addDataBlockToInode(parentinode,dirSize/BLOCK_SIZE,blockNumber); // Add new block to the inode
 		else
+		{
+			iput(parent_inode);
 			return; // No more blocks to allocate in the entire file system
+		}
+		bp = getblk(blockNumber);
+		clrbuf(bp);
 	}
+	else
+		bp = bread(blockNumber);
 
 	// write the directory entry
-	lseek(fd,BLOCK_POSITION(blockNumber) + offset,SEEK_SET);
-	write(fd,&dir,sizeof(dir));
+	memcpy(bp->data + offset,&dir,sizeof(dir));
+	bdwrite(bp);
+
+	dcacheEnter(parentinode,dir.name,newinode);
+	dirInfoAdd(parentinode,dir.name,dirSize / sizeof(dir));
+
+	// add the name to the index of a hashed directory
+	dirIndexAdd(parentinode,dir.name,dirSize / sizeof(dir));
 	
 	//change directory size
 	dirSize = dirSize + sizeof(dir);
-	parent_inode.size0 = dirSize >> 16;
-	parent_inode.size1 = dirSize & (256*256 -1);
+	setInodeSize(parent_inode,dirSize);
 
 	//write changes to the parentinode
-	lseek(fd,INODE_POSITION(parentinode),SEEK_SET);
-	write(fd,&parent_inode,sizeof(parent_inode));
+	imarkdirty(parent_inode);
+	iput(parent_inode);
 }
 
 
 
 /***********************************************************************
- get_free_inode function:
-    1) if ninode is greater than 0, returns the free i-number from the i-listand decrements the ninode
-	 	else loops through all the i nodes and fills the i-list by checking the allocated flag of each inode
-		 			tries again after filling
+ Hashed directories (initfs -d):
+	The entries of the directory stay in its data blocks as before, the
+	index maps the hash of a name to the slot of its entry. The index root
+	holds DIR_INDEX_BUCKETS chains of index blocks, a lookup reads the root,
+	the chain of one bucket and the directory block of each slot whose
+	hash matches. The root is found through an empty slot (inode 0) after
+	. and .., so a directory scan does not see it.
+	A new directory has no index blocks: the root is allocated with the
+	first name added after . and .., which are not indexed (they are
+	always in slots 0 and 1). Neighbouring buckets share one index block,
+	a full block is split between the halves of its range of buckets, so
+	the index grows with the number of names, not of buckets. Only a
+	single bucket gets a chain of blocks.
 ***********************************************************************/
-unsigned int get_free_inode(){
-	sb.fmod = 1;
-	if(sb.ninode > 0)
+
+/* FNV-1a hash of the name as it is stored in a directory entry */
+unsigned int dirHash(char *name)
+{
+	unsigned int hash = 2166136261u;
+	unsigned int i;
+	for(i=0;i<sizeof(((directoryitem_t*)0)->name) && name[i];i++)
 	{
-		sb.ninode--;
-		return sb.inode[sb.ninode];
+		hash ^= (unsigned char)name[i];
+		hash *= 16777619u;
 	}
-	else // if there is no inode loop through the i list and copy unallocated inodes to inode[]
-	{	
-		int i;
+	return hash;
+}
 
-		inode_t tempinode;
-		for(i=2;i<=(numberOfInodes) && sb.ninode < len(sb.inode);i++)
-		{
-			lseek(fd,INODE_POSITION(i),SEEK_SET);
-			short isAllocated = 0;
-			read(fd,&tempinode,sizeof(tempinode));
-			isAllocated = (tempinode.flags >> 15); // 1st bit
-			if(isAllocated == 0){
-				sb.inode[sb.ninode] = i;
-				sb.ninode++;
-			}
-		}
-		if(sb.ninode == 0)
-			return 0; // all i-nodes are allocated
-		else 
-			return get_free_inode(); // try again to get inode
-	}
+/* Returns the index root of a hashed directory, 0 if the directory is not hashed */
+unsigned int dirIndexRoot(int inode_number)
+{
+	inode_t directoryInode;
+	readInode(inode_number,&directoryInode);
+	if(!(directoryInode.flags & (1 << 9)))
+		return 0;
+
+	unsigned int blockNumber = getBlockToRead(0,inode_number);
+	if(blockNumber == 0)
+		return 0;
+	buf_t *bp = bread(blockNumber);
+	dirindexslot_t *slot = (dirindexslot_t*)(bp->data + DIR_INDEX_SLOT * sizeof(directoryitem_t));
+	unsigned int root = (slot->inode == 0 && slot->magic == DIR_INDEX_MAGIC) ? slot->root : 0;
+	brelse(bp);
+	return root;
 }
 
-/***********************************************************************
- add_free_inode function:
-    Adds the passed i-number to the i-list if it is not full
-***********************************************************************/
-void add_free_inode(int inumber)
+/* Keeps the index slot in the first block of a new directory, after the given . and .. entries.
+   The root is allocated by dirIndexAttach when the first other name is added */
+void dirIndexCreate(directoryitem_t *entries)
 {
-	sb.fmod = 1;
-	if(sb.ninode < len(sb.inode) && (sb.ninode < numberOfInodes))
+	dirindexslot_t *slot = (dirindexslot_t*)&entries[DIR_INDEX_SLOT];
+	memset(slot,0,sizeof(*slot));
+	slot->magic = DIR_INDEX_MAGIC;
+	slot->root = 0;
+}
+
+/* Allocates the index root of a hashed directory that has none yet, returns it or 0 if the
+   directory is not hashed. If no block is free the directory goes back to linear scans */
+unsigned int dirIndexAttach(int inode_number)
+{
+	inode_t directoryInode;
+	readInode(inode_number,&directoryInode);
+	if(!(directoryInode.flags & (1 << 9)))
+		return 0;
+
+	unsigned int blockNumber = getBlockToRead(0,inode_number);
+	buf_t *bp = blockNumber != 0 ? bread(blockNumber) : NULL;
+	dirindexslot_t *slot = bp ? (dirindexslot_t*)(bp->data + DIR_INDEX_SLOT * sizeof(directoryitem_t)) : NULL;
+	unsigned int root = 0;
+	if(slot && slot->inode == 0 && slot->magic == DIR_INDEX_MAGIC)
+		root = get_free_block();
+	if(root == 0)
 	{
-		sb.inode[sb.ninode] = inumber;
-		sb.ninode++;
+		if(bp)
+			brelse(bp);
+		inode_t *ip = iget(inode_number);
+		ip->flags = ip->flags & ~(1 << 9);
+		imarkdirty(ip);
+		iput(ip);
+		return 0;
 	}
+	buf_t *rootbp = getblk(root);
+	clrbuf(rootbp); // empty buckets
+	bdwrite(rootbp);
+
+	slot->root = root;
+	bdwrite(bp);
+	return root;
 }
 
+/* Adds the name in the given slot to the index of the directory, if it is hashed.
+   A directory whose index cannot grow goes back to linear scans */
+void dirIndexAdd(int inode_number,char *name,unsigned int slot)
+{
+	unsigned int root = dirIndexRoot(inode_number);
+	if(root == 0)
+		root = dirIndexAttach(inode_number);
+	if(root != 0 && !dirIndexInsert(root,name,slot))
+		dirIndexDrop(inode_number,root);
+}
 
-/***********************************************************************
-/* loads the existing filesystem 
-***********************************************************************/
-void load(char *args)
+/* Adds the name in the given directory slot to the index, returns 0 if no block is free */
+int dirIndexInsert(unsigned int root,char *name,unsigned int slot)
 {
-	char* fileName;
-	
-	int i;
-	args = strtok(NULL,delimiter);
-	if(args == NULL){
-		printf("Arguments missing!");
-		return;
-	}
-	fileName = args;
+	if(strcmp(name,".") == 0 || strcmp(name,"..") == 0) // always in slots 0 and 1, found without the index
+		return 1;
 
-	// Save existing changes before loading new file system
-	if(fd!=0)
+	unsigned int hash = dirHash(name);
+	unsigned int bucket = hash % DIR_INDEX_BUCKETS;
+	buf_t *rootbp = bread(root);
+	unsigned int *buckets = (unsigned int*)rootbp->data;
+	int rootDirty = 0;
+	buf_t *bp = NULL;
+	dirindexblock_t *ib;
+
+	while(1)
 	{
-		if(sb.fmod)
+		// first index block of the bucket with room
+		unsigned int blockNumber = buckets[bucket];
+		while(blockNumber != 0)
+		{
+			bp = bread(blockNumber);
+			ib = (dirindexblock_t*)bp->data;
+			if(ib->count < DIR_INDEX_ENTRIES_PER_BLOCK)
+				break;
+			blockNumber = ib->next;
+			brelse(bp);
+			bp = NULL;
+		}
+		if(bp != NULL)
+			break;
+
+		// the neighbouring buckets that share the block of this one, or have no block either
+		unsigned int first = bucket, last = bucket, i;
+		while(first > 0 && buckets[first - 1] == buckets[bucket])
+			first--;
+		while(last < DIR_INDEX_BUCKETS - 1 && buckets[last + 1] == buckets[bucket])
+			last++;
+
+		unsigned int newBlock = get_free_block();
+		if(newBlock == 0)
+		{
+			if(rootDirty)
+				bdwrite(rootbp);
+			else
+				brelse(rootbp);
+			return 0;
+		}
+		buf_t *newbp = getblk(newBlock);
+		clrbuf(newbp);
+		dirindexblock_t *nb = (dirindexblock_t*)newbp->data;
+
+		if(buckets[bucket] == 0)
+		{
+			// one block for all of the empty buckets
+			for(i=first;i<=last;i++)
+				buckets[i] = newBlock;
+		}
+		else if(first < last)
+		{
+			// split the full shared block, the upper half of its buckets moves to the new block
+			unsigned int middle = first + (last - first + 1) / 2;
+			buf_t *oldbp = bread(buckets[bucket]);
+			dirindexblock_t *ob = (dirindexblock_t*)oldbp->data;
+			unsigned int kept = 0;
+			for(i=0;i<ob->count;i++)
 			{
-				sb.fmod = 0;
-				// Save super block and close the file
-				lseek(fd, BLOCK_POSITION(1), SEEK_SET); 
-				write(fd,&sb,sizeof(sb));	
+				dirindexblock_t *to = ob->entries[i][0] % DIR_INDEX_BUCKETS >= middle ? nb : ob;
+				unsigned int k = to == ob ? kept++ : nb->count++;
+				to->entries[k][0] = ob->entries[i][0];
+				to->entries[k][1] = ob->entries[i][1];
 			}
+			ob->count = kept;
+			bdwrite(oldbp);
+			for(i=middle;i<=last;i++)
+				buckets[i] = newBlock;
+		}
+		else
+		{
+			// every block of the single bucket is full, add one in front
+			nb->next = buckets[bucket];
+			buckets[bucket] = newBlock;
+		}
+		bdwrite(newbp);
+		rootDirty = 1;
 	}
 
-	// open the file
-	fd = open(fileName,2);
+	if(rootDirty)
+		bdwrite(rootbp);
+	else
+		brelse(rootbp);
 
-	//read super block 
-	lseek(fd, BLOCK_POSITION(1), SEEK_SET);
-	read(fd,&sb,sizeof(sb));
+	ib->entries[ib->count][0] = hash;
+	ib->entries[ib->count][1] = slot;
+	ib->count++;
+	bdwrite(bp);
+	return 1;
+}
 
-	//read number of inodes from super block
-	numberOfInodes = sb.isize * NUMBER_OF_INODES_PER_BLOCK;
+/* Removes the name in the given directory slot from the index */
+void dirIndexRemove(unsigned int root,char *name,unsigned int slot)
+{
+	unsigned int hash = dirHash(name);
+	buf_t *rootbp = bread(root);
+	unsigned int blockNumber = ((unsigned int*)rootbp->data)[hash % DIR_INDEX_BUCKETS];
+	brelse(rootbp);
 
-	if(DEBUG)
+	while(blockNumber != 0)
 	{
-		print_free_inode_list();
-		print_free_block_list();
+		buf_t *bp = bread(blockNumber);
+		dirindexblock_t *ib = (dirindexblock_t*)bp->data;
+		unsigned int i;
+		for(i=0;i<ib->count;i++)
+		{
+			if(ib->entries[i][0] == hash && ib->entries[i][1] == slot)
+			{
+				// move the last entry of the block into the hole
+				ib->count--;
+				ib->entries[i][0] = ib->entries[ib->count][0];
+				ib->entries[i][1] = ib->entries[ib->count][1];
+				bdwrite(bp);
+				return;
+			}
+		}
+		blockNumber = ib->next;
+		brelse(bp);
 	}
 }
 
-/* Function to check if a file exists in the directory
- *	filename- name of the file
- *	parent_inode_number - inode number of the directory	
-*/
+/* Returns the inode of the name in the hashed directory, 0 if it does not exist */
+int dirIndexLookup(int inode_number,unsigned int root,char *fileName)
+{
+	unsigned int hash = dirHash(fileName);
+	buf_t *rootbp = bread(root);
+	unsigned int blockNumber = ((unsigned int*)rootbp->data)[hash % DIR_INDEX_BUCKETS];
+	brelse(rootbp);
+
+	int found = 0;
+	blockmap_t map;
+	bmapOpen(&map,inode_number);
+	while(blockNumber != 0 && !found)
+	{
+		buf_t *bp = bread(blockNumber);
+		dirindexblock_t *ib = (dirindexblock_t*)bp->data;
+		unsigned int i;
+		for(i=0;i<ib->count && !found;i++)
+		{
+			if(ib->entries[i][0] != hash)
+				continue;
+
+			// compare the name in the directory entry, the hash may collide
+			unsigned int offset = ib->entries[i][1] * sizeof(directoryitem_t);
+			unsigned int dirBlock = bmap(&map,offset / BLOCK_SIZE);
+			if(dirBlock == 0)
+				continue;
+			buf_t *dirbp = bread(dirBlock);
+			directoryitem_t *dir = (directoryitem_t*)(dirbp->data + offset % BLOCK_SIZE);
+			if(dir->inode != 0 && strncmp(dir->name,fileName,sizeof(dir->name)) == 0)
+				found = dir->inode;
+			brelse(dirbp);
+		}
+		blockNumber = ib->next;
+		brelse(bp);
+	}
+	bmapClose(&map);
+	return found;
+}
+
+/* Frees the index blocks of all buckets, leaving an empty index */
+void dirIndexClear(unsigned int root)
+{
+	buf_t *rootbp = bread(root);
+	unsigned int *buckets = (unsigned int*)rootbp->data;
+	unsigned int previous = 0;
+	unsigned int i;
+	for(i=0;i<DIR_INDEX_BUCKETS;i++)
+	{
+		unsigned int blockNumber = buckets[i];
+		if(blockNumber == previous) // shared with the bucket before, freed already
+			blockNumber = 0;
+		else
+			previous = blockNumber;
+		while(blockNumber != 0)
+		{
+			buf_t *bp = bread(blockNumber);
+			unsigned int next = ((dirindexblock_t*)bp->data)->next;
+			brelse(bp);
+			binval(blockNumber);
+			add_to_free_list(blockNumber);
+			blockNumber = next;
+		}
+		buckets[i] = 0;
+	}
+	bdwrite(rootbp);
+}
+
+/* Frees the index blocks, the directory (if any) goes back to linear scans */
+void dirIndexDrop(int inode_number,unsigned int root)
+{
+	dirIndexClear(root);
+	binval(root);
+	add_to_free_list(root);
+
+	if(inode_number != 0)
+	{
+		inode_t *directoryInode = iget(inode_number);
+		directoryInode->flags = directoryInode->flags & ~(1 << 9);
+		imarkdirty(directoryInode);
+		iput(directoryInode);
+	}
+}
+
+
+/***********************************************************************
+ get_free_inode function:
+    1) if ninode is greater than 0, returns the free i-number from the i-list and decrements the ninode
+	 	else fills the i-list with the next free inodes of the inode bitmap,
+		starting at esb.inodeRotor, and tries again after filling
+***********************************************************************/
+unsigned int get_free_inode(){
+	sb.fmod = 1;
+	if(esb.freeInodes == 0 && esb.orphanHead != 0) // the inodes of deleted files are needed now
+		reclaimOrphans(~0u);
+	if(sb.ninode > 0)
+	{
+		sb.ninode--;
+		inodeBitmapSet(sb.inode[sb.ninode],1);
+		esb.freeInodes--;
+		return sb.inode[sb.ninode];
+	}
+	else // if there is no inode copy the free inodes after the rotor to inode[]
+	{	
+		if(!inodeBitmapBuilt)
+			inodeBitmapBuild();
+
+		unsigned int rotor = esb.inodeRotor;
+		if(rotor < 2 || rotor > (unsigned int)numberOfInodes)
+			rotor = 2;
+
+		// search from the rotor to the last inode, then wrap around
+		esb.inodeRotor = inodeBitmapScan(rotor,numberOfInodes + 1);
+		if(sb.ninode < len(sb.inode))
+			esb.inodeRotor = inodeBitmapScan(2,rotor);
+
+		if(sb.ninode == 0)
+			return 0; // all i-nodes are allocated
+		else 
+			return get_free_inode(); // try again to get inode
+	}
+}
+
+/***********************************************************************
+ add_free_inode function:
+    Marks the inode free in the inode bitmap and adds the passed i-number
+	to the i-list if it is not full
+***********************************************************************/
+void add_free_inode(int inumber)
+{
+	sb.fmod = 1;
+	inodeBitmapSet(inumber,0);
+	esb.freeInodes++;
+	if(sb.ninode < len(sb.inode) && (sb.ninode < numberOfInodes))
+	{
+		sb.inode[sb.ninode] = inumber;
+		sb.ninode++;
+	}
+}
+
+/***********************************************************************
+ Inode bitmap:
+	One bit per inode, set when the inode is allocated or has been handed
+	out by get_free_inode. The inode table stays the only record on the
+	disk, the bitmap is built from it by one sequential read the first
+	time the i-list runs dry after a load, and kept up to date by
+	get_free_inode and add_free_inode. A refill of the i-list scans it
+	64 inodes at a time from esb.inodeRotor, skipping groups without a
+	free inode (inodeGroupFree), instead of reading inodes from inode 2.
+***********************************************************************/
+
+// Allocates the bitmap and its summaries for numberOfInodes inodes, all of them in use
+void inodeBitmapAllocate()
+{
+	unsigned int words = (numberOfInodes + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS;
+	unsigned int groups = (numberOfInodes + INODES_PER_GROUP - 1) / INODES_PER_GROUP;
+	inodeBitmapDrop();
+	inodeBitmap = malloc((words ? words : 1) * sizeof(unsigned long long));
+	memset(inodeBitmap,0xff,(words ? words : 1) * sizeof(unsigned long long));
+	inodeGroupFree = calloc(groups ? groups : 1,sizeof(unsigned int));
+	inodeBitmapBuilt = 1;
+}
+
+/* Adds the free inodes of [from, to) to the i-list until it is full, returns the inode the search stopped at */
+unsigned int inodeBitmapScan(unsigned int from,unsigned int to)
+{
+	unsigned int inode_number = from;
+	while(inode_number < to && sb.ninode < len(sb.inode))
+	{
+		unsigned int bit = inode_number - 1;
+		unsigned int group = bit / INODES_PER_GROUP;
+		if(inodeGroupFree[group] == 0) // no free inode in this group
+		{
+			inode_number = (group + 1) * INODES_PER_GROUP + 1;
+			continue;
+		}
+
+		// ignore the bits below the inode in its word
+		unsigned long long word = inodeBitmap[bit / BITMAP_WORD_BITS] | ((1ULL << (bit % BITMAP_WORD_BITS)) - 1);
+		if(word == ~0ULL)
+		{
+			inode_number = (bit / BITMAP_WORD_BITS + 1) * BITMAP_WORD_BITS + 1;
+			continue;
+		}
+
+		inode_number = (bit / BITMAP_WORD_BITS) * BITMAP_WORD_BITS + __builtin_ctzll(~word) + 1;
+		if(inode_number >= to)
+			break;
+		sb.inode[sb.ninode++] = inode_number++;
+	}
+	return inode_number < to ? inode_number : to;
+}
+
+/* Marks the inode as used or free and updates the summary of its group */
+void inodeBitmapSet(int inode_number,int used)
+{
+	if(!inodeBitmapBuilt || inode_number < 1 || inode_number > numberOfInodes)
+		return;
+	unsigned int bit = inode_number - 1;
+	unsigned long long mask = 1ULL << (bit % BITMAP_WORD_BITS);
+	unsigned long long *word = &inodeBitmap[bit / BITMAP_WORD_BITS];
+	if(used && !(*word & mask))
+	{
+		*word |= mask;
+		inodeGroupFree[bit / INODES_PER_GROUP]--;
+	}
+	else if(!used && (*word & mask))
+	{
+		*word &= ~mask;
+		inodeGroupFree[bit / INODES_PER_GROUP]++;
+	}
+}
+
+/* Creates the bitmap of a new file system, every inode but the root is free */
+void inodeBitmapInit()
+{
+	int i;
+	inodeBitmapAllocate();
+	for(i=2;i<=numberOfInodes;i++)
+		inodeBitmapSet(i,0);
+}
+
+/* Builds the bitmap from the allocation flags of the inode table, the inode blocks are read
+   around the buffer cache ZERO_CHUNK_BLOCKS at a time */
+void inodeBitmapBuild()
+{
+	unsigned int blocks = (numberOfInodes + NUMBER_OF_INODES_PER_BLOCK - 1) / NUMBER_OF_INODES_PER_BLOCK;
+	unsigned int block, i;
+	char *chunk = malloc(ZERO_CHUNK_BLOCKS * BLOCK_SIZE);
+
+	inodeBitmapAllocate();
+
+	// the incore inodes and the cached inode blocks have to be on the disk first
+	iflush();
+	bflushBlocks(2,blocks);
+
+	for(block = 0; block < blocks; block += ZERO_CHUNK_BLOCKS)
+	{
+		unsigned int n = blocks - block < ZERO_CHUNK_BLOCKS ? blocks - block : ZERO_CHUNK_BLOCKS;
+		// inode blocks never written by a lazily initialized file system hold free inodes
+		if((esb.features & FEATURE_LAZY_INODES) && block + n > esb.inodeBlocksInit)
+		{
+			unsigned int written = esb.inodeBlocksInit > block ? esb.inodeBlocksInit - block : 0;
+			memset(chunk + written * BLOCK_SIZE,0,(n - written) * BLOCK_SIZE);
+			if(written > 0)
+				pread(fd,chunk,written * BLOCK_SIZE,BLOCK_POSITION((off_t)(2 + block)));
+		}
+		else
+			pread(fd,chunk,n * BLOCK_SIZE,BLOCK_POSITION((off_t)(2 + block)));
+
+		for(i=0;i<n * NUMBER_OF_INODES_PER_BLOCK;i++)
+		{
+			int inode_number = block * NUMBER_OF_INODES_PER_BLOCK + i + 1;
+			inode_t *inode = (inode_t*)(chunk + i * INODE_SIZE_BYTES);
+			if(inode_number > numberOfInodes)
+				break;
+			if(inode_number != 1 && !(inode->flags >> 15))
+				inodeBitmapSet(inode_number,0);
+		}
+	}
+	free(chunk);
+	inodeBitmapBuilds++;
+}
+
+/* Forgets the bitmap, used when a different file system is loaded */
+void inodeBitmapDrop()
+{
+	free(inodeBitmap);
+	free(inodeGroupFree);
+	inodeBitmap = NULL;
+	inodeGroupFree = NULL;
+	inodeBitmapBuilt = 0;
+}
+
+
+/***********************************************************************
+/* loads the existing filesystem 
+***********************************************************************/
+void load(char *args)
+{
+	char* fileName;
+	
+	int i;
+	args = strtok(NULL,delimiter);
+	if(args == NULL){
+		printf("Arguments missing!");
+		return;
+	}
+	fileName = args;
+
+	// Optional argument
+	//		--mmap  map the image, cached blocks point into the mapping instead of being read and written
+	int useMmap = 0;
+	while((args = strtok(NULL,delimiter)) != NULL)
+	{
+		if(strcmp(args,"--mmap") == 0)
+			useMmap = 1;
+		else
+		{
+			printf("Unknown option %s",args);
+			return;
+		}
+	}
+
+	// Save existing changes before loading new file system
+	if(fd!=0)
+	{
+		saveFileSystem();
+		ipurge();
+		bpurge();
+		dcachePurge();
+		dirInfoPurge();
+		inodeBitmapDrop();
+		mapRelease();
+	}
+
+	// open the file
+	fd = open(fileName,2);
+
+	//read extended super block first, it gives the block size. Images without one use the V6 defaults
+	lseek(fd, 0, SEEK_SET);
+	read(fd,&esb,sizeof(esb));
+	if(esb.magic != FS_MAGIC)
+	{
+		memset(&esb,0,sizeof(esb));
+		esb.magic = FS_MAGIC;
+		esb.version = 1; // no free counts, they are counted below
+	}
+	if(esb.blockSize == 0)
+		esb.blockSize = DEFAULT_BLOCK_SIZE;
+	blockSize = esb.blockSize;
+
+	//read super block 
+	lseek(fd, BLOCK_POSITION(1), SEEK_SET);
+	read(fd,&sb,sizeof(sb));
+
+	// map the whole disk, an image shorter than fsize blocks is extended first (the mapping cannot reach past its end)
+	if(useMmap)
+	{
+		struct stat fileStat;
+		mapSize = BLOCK_POSITION((off_t)sb.fsize);
+		if(fstat(fd,&fileStat) == 0 && fileStat.st_size < (off_t)mapSize)
+			ftruncate(fd,mapSize);
+		mapBase = mmap(NULL,mapSize,PROT_READ | PROT_WRITE,MAP_SHARED,fd,0);
+		if(mapBase == MAP_FAILED)
+		{
+			printf("Cannot map %s, blocks are read and written without the mapping",fileName);
+			mapBase = NULL;
+			mapSize = 0;
+		}
+	}
+	if(esb.features & FEATURE_BLOCK_BITMAP)
+		bitmapLoad();
+
+	//read number of inodes from super block
+	numberOfInodes = sb.isize * NUMBER_OF_INODES_PER_BLOCK;
+
+	// images of version 1 have no free counts, count once and save them with the next q
+	if(esb.version < 2)
+	{
+		countFree();
+		esb.version = FS_VERSION;
+		sb.fmod = 1;
+	}
+
+	if(DEBUG)
+	{
+		print_free_inode_list();
+		print_free_block_list();
+	}
+}
+
+/***********************************************************************
+ Free space accounting:
+	esb.freeBlocks and esb.freeInodes are updated by every allocation
+	and free, and saved with the extended super block, so df answers
+	without reading the free list, the bitmap or the inode table.
+	countFree computes them once for images written before the counts
+	were kept.
+***********************************************************************/
+
+/* Counts the free blocks and inodes of the loaded file system */
+void countFree()
+{
+	unsigned int i;
+	esb.freeBlocks = 0;
+	if(esb.features & FEATURE_BLOCK_BITMAP)
+	{
+		for(i=0;i<esb.bitmapBlocks;i++)
+			esb.freeBlocks += bitmapGroupFree[i];
+	}
+	else
+	{
+		// every entry of the super block and of the free-chain blocks is a free block, except block zero at the end of the chain
+		firstfreeblock_t freeBlock;
+		unsigned int next = sb.free[0];
+		esb.freeBlocks = sb.nfree - (next == 0 ? 1 : 0);
+		for(i=0;next != 0 && i<sb.fsize;i++)
+		{
+			readBlock(next,&freeBlock,sizeof(freeBlock));
+			next = freeBlock.free[0];
+			esb.freeBlocks += freeBlock.nfree - (next == 0 ? 1 : 0);
+		}
+	}
+
+	inodeBitmapBuild();
+	esb.freeInodes = 0;
+	for(i=0;i<((unsigned int)numberOfInodes + INODES_PER_GROUP - 1) / INODES_PER_GROUP;i++)
+		esb.freeInodes += inodeGroupFree[i];
+}
+
+/* df: prints the size of the disk and its free data blocks and inodes */
+void df()
+{
+	unsigned int dataStart = 2 + sb.isize + ((esb.features & FEATURE_BLOCK_BITMAP) ? esb.bitmapBlocks : 0);
+	unsigned int dataBlocks = sb.fsize > dataStart ? sb.fsize - dataStart : 0;
+	printf("Block size: %d bytes\n",BLOCK_SIZE);
+	printf("Blocks: %u total, %u data, %u used, %u free (%llu bytes free)",sb.fsize,dataBlocks,dataBlocks - esb.freeBlocks,esb.freeBlocks,(unsigned long long)esb.freeBlocks * BLOCK_SIZE);
+	printf("\nInodes: %d total, %u used, %u free",numberOfInodes,numberOfInodes - esb.freeInodes,esb.freeInodes);
+	if(esb.orphans > 0)
+		printf("\nDeleted files whose blocks are still being freed: %u",esb.orphans);
+}
+
+/***********************************************************************
+ Dentry cache:
+	Remembers the inode found for a name in a directory, or that the name
+	does not exist there, so resolving a path does not scan the directories
+	along it again. Adding and deleting directory entries update the cached
+	result. Entries are reused in clock order, an entry looked up since the
+	hand last passed it is skipped once.
+***********************************************************************/
+
+// Returns the hash chain of the name in the directory
+int dcacheHash(int parent_inode_number,char *fileName)
+{
+	return (dirHash(fileName) + parent_inode_number * 2654435761u) % DENTRY_HASH_SIZE;
+}
+
+// Returns the cache entry of the name in the directory, NULL if it is not cached
+dentry_t* dcacheFind(int parent_inode_number,char *fileName)
+{
+	int k;
+	if(!dcacheInitialized)
+		dcachePurge();
+	for(k = dhash[dcacheHash(parent_inode_number,fileName)]; k != -1; k = dcache[k].hashnext)
+		if(dcache[k].parent == parent_inode_number && strncmp(dcache[k].name,fileName,sizeof(dcache[k].name)) == 0)
+			return &dcache[k];
+	return NULL;
+}
+
+// Removes the entry from its hash chain and marks it unused
+void dcacheRemove(dentry_t *dp)
+{
+	int k = dp - dcache;
+	int *link = &dhash[dcacheHash(dp->parent,dp->name)];
+	while(*link != -1 && *link != k)
+		link = &dcache[*link].hashnext;
+	if(*link == k)
+		*link = dp->hashnext;
+	dp->parent = 0;
+}
+
+/* Returns 1 and the inode of the name (0 if it does not exist) if the lookup is cached */
+int dcacheLookup(int parent_inode_number,char *fileName,int *inode_number)
+{
+	dentry_t *dp = dcacheFind(parent_inode_number,fileName);
+	if(dp == NULL)
+	{
+		dentryMisses++;
+		return 0;
+	}
+	dentryHits++;
+	dp->referenced = 1;
+	*inode_number = dp->child;
+	return 1;
+}
+
+/* Records the inode of the name in the directory, 0 if the name does not exist */
+void dcacheEnter(int parent_inode_number,char *fileName,int inode_number)
+{
+	dentry_t *dp = dcacheFind(parent_inode_number,fileName);
+	if(dp == NULL)
+	{
+		// advance the clock hand to an unused entry or one not looked up since the last pass
+		while(dcache[dcacheHand].parent != 0 && dcache[dcacheHand].referenced)
+		{
+			dcache[dcacheHand].referenced = 0;
+			dcacheHand = (dcacheHand + 1) % NDENTRY;
+		}
+		dp = &dcache[dcacheHand];
+		dcacheHand = (dcacheHand + 1) % NDENTRY;
+		if(dp->parent != 0)
+			dcacheRemove(dp);
+
+		dp->parent = parent_inode_number;
+		strncpy(dp->name,fileName,sizeof(dp->name));
+		int h = dcacheHash(parent_inode_number,fileName);
+		dp->hashnext = dhash[h];
+		dhash[h] = dp - dcache;
+	}
+	dp->child = inode_number;
+	dp->referenced = 0;
+}
+
+/* Forgets the names cached for the directory, used when the directory is deleted or its inode reused */
+void dcachePurgeDir(int parent_inode_number)
+{
+	int k;
+	if(!dcacheInitialized)
+		return;
+	for(k=0;k<NDENTRY;k++)
+		if(dcache[k].parent == parent_inode_number)
+			dcacheRemove(&dcache[k]);
+}
+
+/* Forgets all cached names, used when a different file system is loaded */
+void dcachePurge()
+{
+	int k;
+	for(k=0;k<NDENTRY;k++)
+		dcache[k].parent = 0;
+	for(k=0;k<DENTRY_HASH_SIZE;k++)
+		dhash[k] = -1;
+	dcacheHand = 0;
+	dcacheInitialized = 1;
+}
+
+/***********************************************************************
+ Directory Bloom filters:
+	The names of recently used directories are kept in a Bloom filter in
+	memory, so looking up a name that does not exist, the common case
+	when files are copied in, is answered without reading the directory.
+	The filter is built by one scan of the directory on first use and
+	names are added as entries are created. A deleted name cannot be
+	taken out, its bits stay set, so the filter is rebuilt once the
+	deleted names or the added ones outnumber what it was sized for.
+	Filters are not written to the disk.
+	The same scan collects the free slots (holes) of the directory, new
+	entries are put in a hole before the directory grows.
+***********************************************************************/
+
+// Returns the information of the directory, NULL if it has none
+dirinfo_t* dirInfoFind(int inode_number)
+{
+	int k;
+	for(k=0;k<NDIRINFO;k++)
+		if(dirinfo[k].inode_number == inode_number)
+			return &dirinfo[k];
+	return NULL;
+}
+
+// Sets or tests (set = 0) the bits of the name, returns 1 if all of them were set
+int dirBloomBits(dirinfo_t *dp,char *fileName,int set)
+{
+	unsigned int h1 = dirHash(fileName);
+	unsigned int h2 = ((h1 >> 16) | (h1 << 16)) * 0x45d9f3b | 1;
+	int allSet = 1;
+	int i;
+	for(i=0;i<BLOOM_HASHES;i++)
+	{
+		unsigned int bit = (h1 + i * h2) & (dp->bloomBits - 1);
+		if(!(dp->bloom[bit / 64] & (1ULL << (bit % 64))))
+		{
+			allSet = 0;
+			if(!set)
+				break;
+			dp->bloom[bit / 64] |= 1ULL << (bit % 64);
+		}
+	}
+	return allSet;
+}
+
+// Records a free slot of the directory
+void dirHoleAdd(dirinfo_t *dp,unsigned int slot)
+{
+	if(dp->nholes == dp->holesSize)
+	{
+		dp->holesSize = dp->holesSize ? dp->holesSize * 2 : 64;
+		dp->holes = realloc(dp->holes,dp->holesSize * sizeof(unsigned int));
+	}
+	dp->holes[dp->nholes++] = slot;
+}
+
+// Builds the filter of the directory from its entries, sized for twice the names in it, and its list of holes
+void dirInfoBuild(dirinfo_t *dp)
+{
+	dirscan_t scan;
+	directoryitem_t *dir;
+	unsigned int slot, nextSlot = 0;
+	if(!dirOpen(&scan,dp->inode_number))
+		return;
+	short isHashed = ((scan.map.inode->flags & (1 << 9)) >> 9);
+
+	unsigned int wanted = (scan.size / sizeof(directoryitem_t)) * 2 * BLOOM_BITS_PER_NAME;
+	unsigned int bits = BLOOM_MIN_BITS;
+	while(bits < wanted)
+		bits *= 2;
+	free(dp->bloom);
+	dp->bloom = calloc(bits / 64,sizeof(unsigned long long));
+	dp->bloomBits = bits;
+	dp->names = 0;
+	dp->deletes = 0;
+	dp->nholes = 0;
+	dp->slots = scan.size / sizeof(directoryitem_t);
+
+	while((dir = dirNext(&scan)) != NULL)
+	{
+		dirBloomBits(dp,dir->name,1);
+		dp->names++;
+
+		// the slots skipped by the scan are holes, except the index root of a hashed directory
+		for(slot = scan.offset / sizeof(directoryitem_t) - 1; nextSlot < slot; nextSlot++)
+			if(!(isHashed && nextSlot == DIR_INDEX_SLOT))
+				dirHoleAdd(dp,nextSlot);
+		nextSlot = slot + 1;
+	}
+	for(; nextSlot < dp->slots; nextSlot++)
+		if(!(isHashed && nextSlot == DIR_INDEX_SLOT))
+			dirHoleAdd(dp,nextSlot);
+	dirClose(&scan);
+	bloomBuilds++;
+}
+
+/* Returns 0 if the name is certainly not in the directory, 1 if it may be */
+int dirBloomMayContain(int inode_number,char *fileName)
+{
+	dirinfo_t *dp = dirInfoFind(inode_number);
+	if(dp == NULL)
+	{
+		// reuse an unused entry or the least recently used one
+		int k;
+		dp = &dirinfo[0];
+		for(k=0;k<NDIRINFO;k++)
+		{
+			if(dirinfo[k].inode_number == 0)
+			{
+				dp = &dirinfo[k];
+				break;
+			}
+			if(dirinfo[k].lastUse < dp->lastUse)
+				dp = &dirinfo[k];
+		}
+		dp->inode_number = inode_number;
+		dp->bloomBits = 0;
+	}
+	dp->lastUse = ++dirinfoClock;
+
+	// too full to be useful: more names than it was sized for, or many deleted ones still set
+	if(dp->bloomBits == 0 || dp->names * BLOOM_BITS_PER_NAME > dp->bloomBits || dp->deletes > dp->names / 2)
+		dirInfoBuild(dp);
+	if(dp->bloomBits == 0) // not a directory
+		return 1;
+
+	if(dirBloomBits(dp,fileName,0))
+		return 1;
+	bloomNegatives++;
+	return 0;
+}
+
+/* Adds the name of a new entry in the given slot to the filter of the directory */
+void dirInfoAdd(int inode_number,char *fileName,unsigned int slot)
+{
+	dirinfo_t *dp = dirInfoFind(inode_number);
+	if(dp == NULL || dp->bloomBits == 0)
+		return;
+	dirBloomBits(dp,fileName,1);
+	dp->names++;
+	if(slot >= dp->slots)
+		dp->slots = slot + 1;
+}
+
+/* Records the slot of a deleted entry as a hole, its name stays in the filter.
+   Returns 1 if the directory should be compacted */
+int dirInfoDelete(int inode_number,unsigned int slot)
+{
+	dirinfo_t *dp = dirInfoFind(inode_number);
+	if(dp == NULL || dp->bloomBits == 0)
+		return 0;
+	dp->deletes++;
+	dirHoleAdd(dp,slot);
+	return DIR_COMPACT_HOLE_PERCENT > 0 && dp->slots > BLOCK_SIZE / sizeof(directoryitem_t)
+			&& dp->nholes * 100 > dp->slots * DIR_COMPACT_HOLE_PERCENT;
+}
+
+/* Returns a free slot of the directory, -1 if none is known */
+int dirHoleTake(int inode_number)
+{
+	dirinfo_t *dp = dirInfoFind(inode_number);
+	if(dp == NULL || dp->bloomBits == 0 || dp->nholes == 0)
+		return -1;
+	return dp->holes[--dp->nholes];
+}
+
+/* Forgets the information of the directory, used when it is deleted or its inode reused */
+void dirInfoDrop(int inode_number)
+{
+	dirinfo_t *dp = dirInfoFind(inode_number);
+	if(dp == NULL)
+		return;
+	free(dp->bloom);
+	free(dp->holes);
+	dp->bloom = NULL;
+	dp->bloomBits = 0;
+	dp->holes = NULL;
+	dp->nholes = dp->holesSize = 0;
+	dp->inode_number = 0;
+}
+
+/* Forgets the information of all directories, used when a different file system is loaded */
+void dirInfoPurge()
+{
+	int k;
+	for(k=0;k<NDIRINFO;k++)
+		if(dirinfo[k].inode_number != 0)
+			dirInfoDrop(dirinfo[k].inode_number);
+}
+
+/***********************************************************************
+ Directory compaction:
+	Rewrites the entries in use into the first slots of the directory,
+	in their current order, and frees the blocks left past the end.
+	The index of a hashed directory is rebuilt since slots change.
+***********************************************************************/
+
+/* Compacts the directory, returns the number of blocks freed */
+int compactDirectory(int inode_number)
+{
+	dirscan_t scan;
+	directoryitem_t *dir;
+	if(!dirOpen(&scan,inode_number))
+		return 0;
+
+	int oldSlots = scan.size / sizeof(directoryitem_t);
+	directoryitem_t *entries = malloc((oldSlots + 1) * sizeof(directoryitem_t));
+	int n = 0;
+	short isHashed = ((scan.map.inode->flags & (1 << 9)) >> 9);
+	unsigned int indexRoot = isHashed ? dirIndexRoot(inode_number) : 0;
+
+	while((dir = dirNext(&scan)) != NULL)
+	{
+		memcpy(&entries[n++],dir,sizeof(directoryitem_t));
+		if(isHashed && n == DIR_INDEX_SLOT)
+		{
+			// the index root (0 until the first name is indexed) stays after . and ..
+			dirindexslot_t *slot = (dirindexslot_t*)&entries[n++];
+			memset(slot,0,sizeof(*slot));
+			slot->magic = DIR_INDEX_MAGIC;
+			slot->root = indexRoot;
+		}
+	}
+	if(scan.bp)
+		brelse(scan.bp);
+	scan.bp = NULL;
+
+	// write the entries densely, zeros after the last one
+	int entriesPerBlock = BLOCK_SIZE / sizeof(directoryitem_t);
+	int newBlocks = (n + entriesPerBlock - 1) / entriesPerBlock;
+	int oldBlocks = (oldSlots + entriesPerBlock - 1) / entriesPerBlock;
+	int i;
+	for(i=0;i<newBlocks;i++)
+	{
+		buf_t *bp = bread(bmap(&scan.map,i));
+		int count = n - i * entriesPerBlock;
+		if(count > entriesPerBlock)
+			count = entriesPerBlock;
+		clrbuf(bp);
+		memcpy(bp->data,&entries[i * entriesPerBlock],count * sizeof(directoryitem_t));
+		bdwrite(bp);
+	}
+	bmapTruncate(&scan.map,oldBlocks,newBlocks);
+
+	int dirSize = n * sizeof(directoryitem_t);
+	setInodeSize(scan.map.inode,dirSize);
+	imarkdirty(scan.map.inode);
+	dirClose(&scan);
+
+	// the slots changed, index the names again
+	if(indexRoot)
+	{
+		dirIndexClear(indexRoot);
+		for(i=0;i<n;i++)
+		{
+			if(entries[i].inode == 0) // index root
+				continue;
+			if(!dirIndexInsert(indexRoot,entries[i].name,i))
+			{
+				dirIndexDrop(inode_number,indexRoot);
+				break;
+			}
+		}
+	}
+	free(entries);
+
+	// no holes left
+	dirinfo_t *dp = dirInfoFind(inode_number);
+	if(dp != NULL)
+	{
+		dp->nholes = 0;
+		dp->slots = n;
+	}
+	return oldBlocks - newBlocks;
+}
+
+/* compactdir [directory path]: compacts the directory, the current directory if no path is given */
+void compactdir(char *args)
+{
+	int inode_number = currentDirectoryInode;
+	args = strtok(NULL,delimiter);
+	if(args != NULL)
+	{
+		if(strspn(args,"/") == strlen(args)) // root
+			inode_number = 1;
+		else
+		{
+			int parent_inode_number = (args[0] == '/') ? 1 : currentDirectoryInode;
+			inode_number = searchFileInFileSystem(args,&parent_inode_number,"");
+			if(inode_number <= 0)
+			{
+				printf("No such directory exists!");
+				return;
+			}
+		}
+	}
+
+	inode_t directoryInode;
+	readInode(inode_number,&directoryInode);
+	if(!((directoryInode.flags >> 15) & ((directoryInode.flags & (1 << 14)) >> 14)))
+	{
+		printf("Not a directory!");
+		return;
+	}
+
+	int freed = compactDirectory(inode_number);
+	readInode(inode_number,&directoryInode);
+	printf("Compacted directory to %d bytes, %d blocks freed",(int)inodeSize(&directoryInode),freed);
+}
+
+/* Function to check if a file exists in the directory
+ *	filename- name of the file
+ *	parent_inode_number - inode number of the directory	
+*/
 int fileExists(char *fileName, int parent_inode_number)
 {
+	int found = 0;
+
+	// names looked up before are answered from the dentry cache, including names that do not exist
+	if(dcacheLookup(parent_inode_number,fileName,&found))
+		return found;
+
+	// names not in the Bloom filter of the directory are not in the directory
+	if(!dirBloomMayContain(parent_inode_number,fileName))
+	{
+		dcacheEnter(parent_inode_number,fileName,0);
+		return 0;
+	}
+
+	// hashed directory, only the bucket of the name is searched
+	unsigned int indexRoot = dirIndexRoot(parent_inode_number);
+	if(indexRoot && strcmp(fileName,".") != 0 && strcmp(fileName,"..") != 0) // . and .. are in the first block, not in the index
+	{
+		found = dirIndexLookup(parent_inode_number,indexRoot,fileName);
+		if(!found)
+			bloomFalsePositives++;
+		dcacheEnter(parent_inode_number,fileName,found);
+		return found;
+	}
+	
+	//Scan the names in the directory and return the inode of the file if it exists, the inodes of the other entries are not read
+	dirscan_t scan;
+	directoryitem_t *dir;
+	unsigned char pattern[sizeof(directoryitem_t)];
+	int length;
+	if(!dirOpen(&scan,parent_inode_number))
+		return 0;
+	dirNamePattern(fileName,pattern,&length);
+	if((dir = dirMatch(&scan,pattern,sizeof(dir->inode),length)) != NULL)
+		found = dir->inode;
+	dirClose(&scan);
+	if(!found)
+		bloomFalsePositives++;
+	dcacheEnter(parent_inode_number,fileName,found);
+	return found;
+}
+
+/***********************************************************************
+ Directory scan:
+	dirNext returns the entries in use one at a time, straight from the
+	directory block in the buffer cache. Lookups compare names without
+	reading the inode of every entry; getDirectoryContents reads them for
+	ls and rm, which need the type and size of every entry.
+***********************************************************************/
+
+/* Starts a scan of the directory, returns 0 if the inode is not an allocated directory */
+int dirOpen(dirscan_t *scan,int inode_number)
+{
+	bmapOpen(&scan->map,inode_number);
+	short isAllocated = (scan->map.inode->flags >> 15); // 1st bit
+	short isDirectory = ((scan->map.inode->flags & (1 << 14)) >> 14); // 2nd bit
+	if(!(isAllocated & isDirectory))
+	{
+		bmapClose(&scan->map);
+		return 0;
+	}
+	scan->bp = NULL;
+	scan->offset = 0;
+	scan->size = inodeSize(scan->map.inode);
+	return 1;
+}
+
+/* Returns the next entry in use, NULL at the end of the directory.
+   The entry points into the directory block and is valid until the next call */
+directoryitem_t* dirNext(dirscan_t *scan)
+{
+	while(scan->offset < scan->size)
+	{
+		if(scan->bp == NULL || scan->offset % BLOCK_SIZE == 0)
+		{
+			if(scan->bp)
+				brelse(scan->bp);
+			scan->bp = NULL;
+			unsigned int blockNumber = bmap(&scan->map,scan->offset / BLOCK_SIZE);
+			if(blockNumber == 0)
+				return NULL;
+			scan->bp = bread(blockNumber);
+		}
+		directoryitem_t *dir = (directoryitem_t*)(scan->bp->data + scan->offset % BLOCK_SIZE);
+		scan->offset += sizeof(directoryitem_t);
+		if(dir->inode != 0) // If the file/directory is not deleted
+			return dir;
+	}
+	return NULL;
+}
+
+/* Ends the scan */
+void dirClose(dirscan_t *scan)
+{
+	if(scan->bp)
+		brelse(scan->bp);
+	bmapClose(&scan->map);
+}
+
+/* Returns the next entry in use whose bytes first..first+length-1 equal those of the pattern,
+   NULL at the end of the directory. The entries of a block are compared DIR_MATCH_ENTRIES at once by dirBlockMatch */
+directoryitem_t* dirMatch(dirscan_t *scan,unsigned char *pattern,int first,int length)
+{
+	if(dirBlockMatch == NULL)
+		dirBlockMatch = dirBlockMatchScalar;
+#ifdef DIR_MATCH_X86
+	if(dirBlockMatch == dirBlockMatchScalar)
+		dirBlockMatch = __builtin_cpu_supports("avx2") ? dirBlockMatchAVX2 : dirBlockMatchSSE2;
+#endif
+
+	while(scan->offset < scan->size)
+	{
+		if(scan->bp == NULL || scan->offset % BLOCK_SIZE == 0)
+		{
+			if(scan->bp)
+				brelse(scan->bp);
+			scan->bp = NULL;
+			unsigned int blockNumber = bmap(&scan->map,scan->offset / BLOCK_SIZE);
+			if(blockNumber == 0)
+				return NULL;
+			scan->bp = bread(blockNumber);
+		}
+
+		// entries left in this part of the block, from the next one to the end of the part or the directory
+		int segment = DIR_MATCH_ENTRIES * sizeof(directoryitem_t);
+		int blockStart = scan->offset - scan->offset % segment;
+		int entries = (scan->size - blockStart) / sizeof(directoryitem_t);
+		if(entries > DIR_MATCH_ENTRIES)
+			entries = DIR_MATCH_ENTRIES;
+		int next = (scan->offset - blockStart) / sizeof(directoryitem_t);
+
+		unsigned int matches = dirBlockMatch(scan->bp->data + blockStart % BLOCK_SIZE,entries,pattern,first,length);
+		matches &= ~0u << next; // entries before the scan position were returned already
+		while(matches)
+		{
+			int i = __builtin_ctz(matches);
+			directoryitem_t *dir = (directoryitem_t*)(scan->bp->data + blockStart % BLOCK_SIZE + i * sizeof(directoryitem_t));
+			matches &= matches - 1;
+			if(dir->inode != 0)
+			{
+				scan->offset = blockStart + (i + 1) * sizeof(directoryitem_t);
+				return dir;
+			}
+		}
+		scan->offset = blockStart + entries * sizeof(directoryitem_t);
+		if(entries < DIR_MATCH_ENTRIES) // end of the directory
+			break;
+	}
+	return NULL;
+}
+
+/* Fills the pattern of a directory entry with the name. length is the number of name bytes to compare,
+   the terminating zero included, the bytes after it may hold anything in a stored entry */
+void dirNamePattern(char *fileName,unsigned char *pattern,int *length)
+{
+	int nameSize = sizeof(((directoryitem_t*)0)->name);
+	memset(pattern,0,sizeof(directoryitem_t));
+	memcpy(pattern + sizeof(((directoryitem_t*)0)->inode),fileName,strnlen(fileName,nameSize)); // the pattern is zeroed, the terminator is already there
+	*length = strnlen(fileName,nameSize) + 1;
+	if(*length > nameSize)
+		*length = nameSize;
+}
+
+/***********************************************************************
+ Directory block compare:
+	A directory entry is 32 bytes, a 1024 byte block holds 32 entries and
+	larger blocks are compared 32 entries at a time, so the result of
+	comparing them fits in one 32 bit mask, bit i set
+	when bytes first..first+length-1 of entry i equal the pattern. The
+	AVX2 kernel compares a whole entry with one instruction, SSE2 with
+	two, the scalar kernel is used on other processors. bench compares
+	the kernels.
+***********************************************************************/
+
+unsigned int dirBlockMatchScalar(char *block,int entries,unsigned char *pattern,int first,int length)
+{
+	unsigned int matches = 0;
 	int i;
-	int noOfitems=0;
-	
-	directoryContent* list = getDirectoryContents(&noOfitems,parent_inode_number);
+	for(i=0;i<entries;i++)
+		if(memcmp(block + i * sizeof(directoryitem_t) + first,pattern + first,length) == 0)
+			matches |= 1u << i;
+	return matches;
+}
 
-	//Loop through all the contents of the directory and return the inode of the file if it exists	
-	for(i=0;i<noOfitems;i++)
-	{	
-		if(strcmp(list[i].name,fileName)==0)
-		{
-			return list[i].inode;
-		}
+#ifdef DIR_MATCH_X86
+// bytes first..first+length-1 of an entry
+unsigned int dirCompareMask(int first,int length)
+{
+	return (length >= 32 ? ~0u : ((1u << length) - 1)) << first;
+}
+
+unsigned int dirBlockMatchSSE2(char *block,int entries,unsigned char *pattern,int first,int length)
+{
+	unsigned int mask = dirCompareMask(first,length);
+	__m128i low = _mm_loadu_si128((__m128i*)pattern);
+	__m128i high = _mm_loadu_si128((__m128i*)(pattern + 16));
+	unsigned int matches = 0;
+	int i;
+	for(i=0;i<entries;i++)
+	{
+		char *entry = block + i * sizeof(directoryitem_t);
+		unsigned int equal = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((__m128i*)entry),low))
+			| (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((__m128i*)(entry + 16)),high)) << 16);
+		matches |= (unsigned int)((equal & mask) == mask) << i;
+	}
+	return matches;
+}
+
+__attribute__((target("avx2")))
+unsigned int dirBlockMatchAVX2(char *block,int entries,unsigned char *pattern,int first,int length)
+{
+	unsigned int mask = dirCompareMask(first,length);
+	__m256i p = _mm256_loadu_si256((__m256i*)pattern);
+	unsigned int matches = 0;
+	int i;
+	for(i=0;i<entries;i++)
+	{
+		__m256i entry = _mm256_loadu_si256((__m256i*)(block + i * sizeof(directoryitem_t)));
+		unsigned int equal = _mm256_movemask_epi8(_mm256_cmpeq_epi8(entry,p));
+		matches |= (unsigned int)((equal & mask) == mask) << i;
+	}
+	return matches;
+}
+#endif
+
+/***********************************************************************
+ Zero block test:
+	cpin leaves a hole instead of a data block for every block of the
+	input that holds only zeros. The test ORs the block together 16 or
+	32 bytes per instruction with SSE2 or AVX2 and stops at the first
+	non-zero chunk, the scalar kernel works 8 bytes at a time.
+***********************************************************************/
+
+/* Returns 1 if the first size bytes of data are all zero */
+int blockIsZero(char *data,int size)
+{
+	if(zeroTest == NULL)
+	{
+		zeroTest = zeroTestScalar;
+#ifdef DIR_MATCH_X86
+		zeroTest = __builtin_cpu_supports("avx2") ? zeroTestAVX2 : zeroTestSSE2;
+#endif
+	}
+	return zeroTest(data,size);
+}
+
+int zeroTestScalar(char *data,int size)
+{
+	int i = 0;
+	unsigned long long word;
+	for(; i + (int)sizeof(word) <= size; i += sizeof(word))
+	{
+		memcpy(&word,data + i,sizeof(word));
+		if(word != 0)
+			return 0;
+	}
+	for(; i < size; i++)
+		if(data[i] != 0)
+			return 0;
+	return 1;
+}
+
+#ifdef DIR_MATCH_X86
+int zeroTestSSE2(char *data,int size)
+{
+	int i = 0;
+	for(; i + 64 <= size; i += 64)
+	{
+		__m128i any = _mm_or_si128(_mm_or_si128(_mm_loadu_si128((__m128i*)(data + i)),_mm_loadu_si128((__m128i*)(data + i + 16))),
+								   _mm_or_si128(_mm_loadu_si128((__m128i*)(data + i + 32)),_mm_loadu_si128((__m128i*)(data + i + 48))));
+		if(_mm_movemask_epi8(_mm_cmpeq_epi8(any,_mm_setzero_si128())) != 0xffff)
+			return 0;
+	}
+	return zeroTestScalar(data + i,size - i);
+}
+
+__attribute__((target("avx2")))
+int zeroTestAVX2(char *data,int size)
+{
+	int i = 0;
+	for(; i + 128 <= size; i += 128)
+	{
+		__m256i any = _mm256_or_si256(_mm256_or_si256(_mm256_loadu_si256((__m256i*)(data + i)),_mm256_loadu_si256((__m256i*)(data + i + 32))),
+									  _mm256_or_si256(_mm256_loadu_si256((__m256i*)(data + i + 64)),_mm256_loadu_si256((__m256i*)(data + i + 96))));
+		if(!_mm256_testz_si256(any,any))
+			return 0;
+	}
+	return zeroTestScalar(data + i,size - i);
+}
+#endif
+
+/* bench [iterations]: times the directory block compare kernels on a block of 32 names */
+void bench(char *args)
+{
+	int iterations = 1000000;
+	args = strtok(NULL,delimiter);
+	if(args != NULL)
+		iterations = atoi(args);
+	if(iterations <= 0)
+	{
+		printf("Invalid number of iterations");
+		return;
+	}
+
+	// a full directory block of DEFAULT_BLOCK_SIZE bytes, the name looked up is in the last entry
+	char block[DIR_MATCH_ENTRIES * sizeof(directoryitem_t)];
+	directoryitem_t *entries = (directoryitem_t*)block;
+	int i;
+	memset(block,0x5a,sizeof(block)); // bytes after the names are not zero in a real directory
+	for(i=0;i<DIR_MATCH_ENTRIES;i++)
+	{
+		entries[i].inode = i + 2;
+		sprintf(entries[i].name,"file_%04d.txt",i);
+	}
+	unsigned char pattern[sizeof(directoryitem_t)];
+	int length;
+	dirNamePattern(entries[DIR_MATCH_ENTRIES - 1].name,pattern,&length);
+
+	const char *names[3] = {"scalar","sse2","avx2"};
+	unsigned int (*kernels[3])(char*,int,unsigned char*,int,int) = {dirBlockMatchScalar,NULL,NULL};
+#ifdef DIR_MATCH_X86
+	kernels[1] = dirBlockMatchSSE2;
+	if(__builtin_cpu_supports("avx2"))
+		kernels[2] = dirBlockMatchAVX2;
+#endif
+
+	for(i=0;i<len(kernels);i++)
+	{
+		if(kernels[i] == NULL)
+			continue;
+		struct timespec start,end;
+		volatile unsigned int result = 0;
+		int n;
+		clock_gettime(CLOCK_MONOTONIC,&start);
+		for(n=0;n<iterations;n++)
+			result += kernels[i](block,DIR_MATCH_ENTRIES,pattern,sizeof(entries->inode),length);
+		clock_gettime(CLOCK_MONOTONIC,&end);
+		double ns = ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / iterations;
+		printf("\n %s\t %.1f ns per block, match mask %08x",names[i],ns,kernels[i](block,DIR_MATCH_ENTRIES,pattern,sizeof(entries->inode),length));
 	}
-	return 0;
 }
 
 /***************************************************************************************
@@ -784,136 +3464,90 @@ directoryContent* getDirectoryContents(int* noOfitems,int inode_number)
 {
 
 	DEBUG_LOG("\n\t Getting contents of dir Inode: %d",inode_number);
-	inode_t directoryInode;
 	inode_t tempInode;
+	dirscan_t scan;
+	directoryitem_t *dir;
+	int j=0;
 
-	short isAllocated = 0;
-	short isDirectory = 0;
-	int i=0,j=0;
-
-	//Read i-node
-	lseek(fd,INODE_POSITION(inode_number),SEEK_SET);
-	read(fd,&directoryInode,sizeof(directoryInode));
-
-	//Check isAllocated
-	isAllocated = (directoryInode.flags >> 15); // 1st bit
-	directoryContent* list;
-
-	//Check isDirectory
-	isDirectory = ((directoryInode.flags & (1 << 14)) >> 14); // 2nd bit
-	
-	if(isAllocated & isDirectory)
-	{
-		//Get the size of the directory
-		int sizeToRead = directoryInode.size0 << 16 | directoryInode.size1;
-		int totalbytesReadPerBlock =0;
-		int totalbytesRead = 0;
-		int blockNumber = 0;
-
-		//Calculate the number of items based on directory size
-		*noOfitems = sizeToRead/sizeof(directoryitem_t);	
-		//Allocate memory for the directory
-		list = malloc(sizeof(directoryContent) * (*noOfitems));
-
-		int bytesread =0;
-		blockNumber=getBlockToRead(totalbytesRead,inode_number);
-		//while all the blocks are read or until the sizeToRead becomes 0 
-		while(sizeToRead!=0 && blockNumber!=0) // --> gets the block based on offset
-		{
-			//read the directory item from the block
-			directoryitem_t dir;
-			lseek(fd,BLOCK_POSITION(blockNumber),SEEK_SET);
-			totalbytesReadPerBlock = 0;
-
-			//Read until the end of the directory or till the sizeToRead becomes 0		
-			while(sizeToRead!=0 && totalbytesReadPerBlock != BLOCK_SIZE)
-			{
-				bytesread = read(fd,&dir,sizeof(dir));
-				totalbytesReadPerBlock += bytesread;
-				totalbytesRead += bytesread;
-				sizeToRead -= bytesread; 
-
-				// If the file/directory is not deleted
-				if(dir.inode!=0)
-				{
-					//Add to list
-					list[j].inode = dir.inode;
-					strcpy(list[j].name,dir.name);
-					j++;
-				}
+	if(!dirOpen(&scan,inode_number))
+		return NULL;
 
-			}
-			blockNumber=getBlockToRead(totalbytesRead,inode_number);
+	//Calculate the number of items based on directory size
+	*noOfitems = scan.size/sizeof(directoryitem_t);	
+	//Allocate memory for the directory
+	directoryContent* list = malloc(sizeof(directoryContent) * (*noOfitems));
 
-		}
+	while((dir = dirNext(&scan)) != NULL)
+	{
+		//Add to list
+		list[j].inode = dir->inode;
+		strncpy(list[j].name,dir->name,sizeof(list[j].name));
+		list[j].isDirectory = 0;
+		list[j].fileSize = 0;
+		j++;
+	}
+	dirClose(&scan);
 
-		// update number of items added to the list
-		*noOfitems = j;
+	// update number of items added to the list
+	*noOfitems = j;
 
-		//updating file size and isDirectory to the list
-		for(j=0;j<*noOfitems;j++)
-		{
-			//read each inode in the list and update the file size and file type
-			lseek(fd,INODE_POSITION(list[j].inode),SEEK_SET);
-			read(fd,&tempInode,sizeof(tempInode));
-			list[j].isDirectory = ((tempInode.flags & (1 << 14)) >> 14);
-			list[j].fileSize = tempInode.size0 << 16 | tempInode.size1;; 
-		}
-		return list;
+	//updating file size and isDirectory to the list
+	for(j=0;j<*noOfitems;j++)
+	{
+		//read each inode in the list and update the file size and file type
+		readInode(list[j].inode,&tempInode);
+		list[j].isDirectory = ((tempInode.flags & (1 << 14)) >> 14);
+		list[j].fileSize = inodeSize(&tempInode);
 	}
-	return NULL;
+	return list;
 }
 
-// function to convert small file into large file
-void makeLargefile(int inode_number)
+// function to convert small file into large file, returns 0 if no block is free for the single indirect block
+int makeLargefile(int inode_number)
 {
-	inode_t currentInode;
+	inode_t *currentInode;
 	int i=0,j=0;
 	DEBUG_LOG("\nMaking Large File");
 	
 	//Read i-node
-	lseek(fd,INODE_POSITION(inode_number),SEEK_SET);
-	read(fd,&currentInode,sizeof(currentInode));
+	currentInode = iget(inode_number);
 
 	// make sure the given file is small file
-	short isLargeFile = ((currentInode.flags & (1 << 12)) >> 12); 
+	short isLargeFile = ((currentInode->flags & (1 << 12)) >> 12); 
 	if(!isLargeFile)
 	{
-		currentInode.flags = currentInode.flags | 1 << 12; // Set as large file
 		int singleIndirectionblockNumber = get_free_block();
+		if(singleIndirectionblockNumber == 0)
+		{
+			iput(currentInode);
+			return 0;
+		}
+		currentInode->flags = currentInode->flags | 1 << 12; // Set as large file
 		
 		//create a single indirect block
-		singleIndirectblock_t sib;
+		buf_t *bp = getblk(singleIndirectionblockNumber);
+		clrbuf(bp);
+		unsigned int *sib = (unsigned int*)bp->data;
 				DEBUG_LOG("\nSingle indirect block number : %d",singleIndirectionblockNumber);
-		//Take  every element of the addr[] and add it to single indirection block
-		for(i=0;i<len(currentInode.addr);i++)
+		//Take  every element of the addr[] and add it to single indirection block, at the same position (holes stay 0)
+		for(i=0;i<len(currentInode->addr);i++)
 		{
-			if(currentInode.addr[i]!=0)
-			{
-				DEBUG_LOG("\nAdded %d to block %d at pos %d" ,currentInode.addr[i], singleIndirectionblockNumber,j);
-				
-				sib.blockNumbers[j++] = currentInode.addr[i];
-				
-			}	
-			currentInode.addr[i] = 0; // Set it to 0, to mark as empty
+			DEBUG_LOG("\nAdded %d to block %d at pos %d" ,currentInode->addr[i], singleIndirectionblockNumber,j);
+			sib[j++] = currentInode->addr[i];
+			currentInode->addr[i] = 0; // Set it to 0, to mark as empty
 		}
 
-		//make other block numbers in single indirect block to 0
-		for(;j<len(sib.blockNumbers);j++)
-			sib.blockNumbers[j] = 0;
-
-		// write single indirect block
-		lseek(fd,BLOCK_POSITION(singleIndirectionblockNumber),SEEK_SET);
-		write(fd,&sib,sizeof(sib)); 
+		// write single indirect block, the other block numbers in it stay 0
+		bdwrite(bp);
 
 		//Add the single indirection block to addr[0]
-		currentInode.addr[0] = singleIndirectionblockNumber;
+		currentInode->addr[0] = singleIndirectionblockNumber;
 
 		// write the i-node
-		lseek(fd,INODE_POSITION(inode_number),SEEK_SET);
-		write(fd,&currentInode,sizeof(currentInode));
+		imarkdirty(currentInode);
 	}
-
+	iput(currentInode);
+	return 1;
 }
 
 /* function to create a directory */
@@ -952,8 +3586,7 @@ void make_dir(char *args)
 		{
 		
 			// Check if it is a directory
-			lseek(fd,INODE_POSITION(new_inode),SEEK_SET);
-			read(fd,&currentInode,sizeof(currentInode));
+			readInode(new_inode,&currentInode);
 			short isDirectory = ((currentInode.flags & (1 << 14)) >> 14); // 2nd bit
 			
 			if(isDirectory)  // if the directory already exists, change the parent directory and go to next token
@@ -965,6 +3598,11 @@ void make_dir(char *args)
 			}
 		}
 			new_inode = get_free_inode(); // new inode for the new directory
+			if(new_inode == 0)
+			{
+				printf("No more inodes to allocate!");
+				return;
+			}
 			
 			int blockNumber = get_free_block(); // get free data block to store the directory contents
 			if(blockNumber == 0)
@@ -1007,9 +3645,11 @@ void rm(char *args)
 	else 
 		currentInode = currentDirectoryInode;
 	
+	// a path without components ("/") names the directory it starts from, the root is refused by deleteDir
 	inode_t current_Inode;
-	int found_inode = 0;
+	int found_inode = currentInode;
 	short isDirectory;
+	readInode(found_inode,&current_Inode);
 	
 	filePath = strtok(filePath,"/"); // Split on '/'
 	
@@ -1019,8 +3659,7 @@ void rm(char *args)
 		if(found_inode = fileExists(filePath,currentInode)) // If file exists
 		{
 			// Check if it is a directory
-			lseek(fd,INODE_POSITION(found_inode),SEEK_SET);
-			read(fd,&current_Inode,sizeof(current_Inode));
+			readInode(found_inode,&current_Inode);
 			isDirectory = ((current_Inode.flags & (1 << 14)) >> 14); // 2nd bit
 			
 			if(isDirectory)
@@ -1048,7 +3687,7 @@ void rm(char *args)
 	else
 	{
 		deleteDirectoryEntry(currentInode,found_inode);
-		deleteFile(found_inode);
+		orphanFile(found_inode);
 	}
 }
 
@@ -1070,8 +3709,7 @@ void deleteDirectoryEntry(int parent_inode_number,int inode_number)
 	//Create Directory Entry
 	directoryitem_t dir;
 
-	lseek(fd,INODE_POSITION(parent_inode_number),SEEK_SET);
-	read(fd,&parent_inode,sizeof(parent_inode));
+	readInode(parent_inode_number,&parent_inode);
 
 	//Check isAllocated
 	isAllocated = (parent_inode.flags >> 15); // 1st bit
@@ -1085,177 +3723,310 @@ void deleteDirectoryEntry(int parent_inode_number,int inode_number)
 		return;
 	}
 
-	int sizeToRead = parent_inode.size0 << 16 | parent_inode.size1;
-	int totalbytesReadPerBlock =0;
-	int totalbytesRead = 0;
+	//Find the entry of the inode, the entries of a block are compared at once
+	dirscan_t scan;
+	directoryitem_t *entry;
+	unsigned char pattern[sizeof(directoryitem_t)];
+	memset(pattern,0,sizeof(pattern));
+	memcpy(pattern,&inode_number,sizeof(entry->inode));
 
-	//Find Data block to delete
-	int blockNumber=getBlockToRead(totalbytesRead,parent_inode_number);
-	int bytesread =0;
+	if(!dirOpen(&scan,parent_inode_number))
+		return;
+	if((entry = dirMatch(&scan,pattern,0,sizeof(entry->inode))) != NULL)
+	{
+		DEBUG_LOG("\nDeleting %s",entry->name);
+		entry->inode = 0; // by  making inode as 0 we are unlinking the file from the directory
+		memcpy(&dir,entry,sizeof(dir));
+		int slot = scan.offset / sizeof(dir) - 1;
+		bdwrite(scan.bp);
+		scan.bp = NULL;
+		dirClose(&scan);
+		dcacheEnter(parent_inode_number,dir.name,0);
+
+		unsigned int indexRoot = dirIndexRoot(parent_inode_number);
+		if(indexRoot)
+			dirIndexRemove(indexRoot,dir.name,slot);
+		printf("\nDeleted '%s'",dir.name);
+
+		// the slot is reused by the next entry added, the directory is rewritten when most of it is holes
+		if(dirInfoDelete(parent_inode_number,slot))
+			compactDirectory(parent_inode_number);
+		return;
+	}
+	dirClose(&scan);
+}
 
-	while(sizeToRead!=0 && blockNumber!=0)
-		{
-			//read the directory item from the block
-			directoryitem_t dir;
-			lseek(fd,BLOCK_POSITION(blockNumber),SEEK_SET); 
-			totalbytesReadPerBlock = 0;
+/* Deletes the directory based on inode_number, with everything below it.
+   The tree is walked depth first with a stack of (directory, scan offset) instead of recursion,
+   every directory is scanned once: its files are unlinked as they are met, without updating the
+   directory that is going away, and its blocks and inode are freed as a whole once it is empty */
+void deleteDir(int inode_number)
+{
+	if(inode_number <= 1)
+	{
+		printf("Error! Cannot delete root directory!");
+		return;
+	}
 
-			//Read until the end of the directory block (1024 bytes/1 BLOCK) or till the sizeToRead becomes 0		
-			while(sizeToRead!=0 && totalbytesReadPerBlock != BLOCK_SIZE)
-			{
-				bytesread = read(fd,&dir,sizeof(dir));
-				totalbytesReadPerBlock += bytesread;
-				totalbytesRead += bytesread;
-				sizeToRead -= bytesread; 
+	// unlink the directory from its parent first
+	int parent_directoryInode = fileExists("..",inode_number);
+	if(parent_directoryInode > 0)
+		deleteDirectoryEntry(parent_directoryInode,inode_number);
 
-				// If the inode number matches the file inode number to be deleted
-					if(dir.inode == inode_number)
-					{
-						DEBUG_LOG("\nDeleting %s",dir.name);
-						dir.inode = 0; // by  making inode as 0 we are unlinking the file from the directory
-						lseek(fd,-bytesread,SEEK_CUR);
-						write(fd,&dir,sizeof(dir));
-						printf("\nDeleted '%s'",dir.name);
-						return;
-					}
+	struct { int inode_number; int offset; } *stack = NULL;
+	int depth = 0, stackSize = 0;
+	dirscan_t scan;
+	directoryitem_t *dir;
+	inode_t childInode;
 
-			}
-			blockNumber=getBlockToRead(totalbytesRead,parent_inode_number);  // --> gets the block based on offset
-		}	
-}
+	stackSize = 16;
+	stack = malloc(stackSize * sizeof(*stack));
+	stack[depth].inode_number = inode_number;
+	stack[depth].offset = 0;
+	depth++;
 
-/* Deletes the directory based on inode_number */
-void deleteDir(int inode_number)
-{
-	inode_t currentInode;
-	int i,j,k;
-	
-	int noOfitems=0;
-	directoryContent* directoryContents = getDirectoryContents(&noOfitems,inode_number);
-	int parent_directoryInode = 1;
-	for(i=0;i<noOfitems;i++)
-	{	// Delete contents other than . and .. as its the directory itself and the parent directory
-		
-		if(strcmp(directoryContents[i].name,"..") == 0 )
+	while(depth > 0)
+	{
+		int current = stack[depth-1].inode_number;
+		int child = 0;
+		if(dirOpen(&scan,current))
 		{
-			parent_directoryInode = directoryContents[i].inode; // storing parent directory inode to remove the deleted directory entry from its parent
-		}
-		else if(strcmp(directoryContents[i].name,".") !=0 &&
-					strcmp(directoryContents[i].name,"..") !=0 )
-					{
-			if(directoryContents[i].isDirectory)
+			scan.offset = stack[depth-1].offset; // continue after the subdirectory removed last
+			while((dir = dirNext(&scan)) != NULL)
 			{
-				deleteDir(directoryContents[i].inode);
+				if(strcmp(dir->name,".") == 0 || strcmp(dir->name,"..") == 0)
+					continue;
+				int entryInode = dir->inode;
+				readInode(entryInode,&childInode);
+				if((childInode.flags & (1 << 14)) >> 14)
+				{
+					child = entryInode;
+					break;
+				}
+				orphanFile(entryInode);
 			}
-			else
+			stack[depth-1].offset = scan.offset;
+			dirClose(&scan);
+		}
+
+		if(child)
+		{
+			// remove the subdirectory before going on with this one
+			if(depth == stackSize)
 			{
-				deleteDirectoryEntry(inode_number,directoryContents[i].inode);
-				deleteFile(directoryContents[i].inode);
+				stackSize *= 2;
+				stack = realloc(stack,stackSize * sizeof(*stack));
 			}
+			stack[depth].inode_number = child;
+			stack[depth].offset = 0;
+			depth++;
+			continue;
 		}
-	}
-
-	deleteDirectoryEntry(parent_directoryInode,inode_number);
 
+		// nothing is left below the directory: free its index, its blocks and its inode
+		unsigned int indexRoot = dirIndexRoot(current);
+		if(indexRoot)
+			dirIndexDrop(0,indexRoot);
+		dcachePurgeDir(current);
+		dirInfoDrop(current);
+		deleteFile(current);
+		depth--;
+	}
+	free(stack);
 }
 
 /* Function to delete the file */
 void deleteFile(int inode_number)
 {
-	inode_t currentInode;
+	inode_t *currentInode;
 	int i,j,k;
+
+	if(inode_number <= 1)
+	{
+		printf("Error! Cannot delete root directory!");
+		return;
+	}
 	
-	lseek(fd,INODE_POSITION(inode_number),SEEK_SET);
-	read(fd,&currentInode,sizeof(currentInode));
+	currentInode = iget(inode_number);
 
-	short isLargeFile = ((currentInode.flags & (1 << 12)) >> 12); 
+	short isLargeFile = ((currentInode->flags & (1 << 12)) >> 12); 
+	short isExtentFile = ((currentInode->flags & (1 << 11)) >> 11); 
+	short isInline = ((currentInode->flags & (1 << 13)) >> 13); 
 	
-	currentInode.flags =0; // set as unallocated inode
+	currentInode->flags =0; // set as unallocated inode
 
-	lseek(fd,INODE_POSITION(inode_number),SEEK_SET);
-	write(fd,&currentInode,sizeof(currentInode));
+	imarkdirty(currentInode);
 
 	int singleIndirectionblockNumber;
 
-	if(isLargeFile)
+	if(isInline)
+	{
+		// the data is in addr[], there is no block to free
+		for(i=0;i<len(currentInode->addr);i++)
+			currentInode->addr[i] = 0;
+	}
+	else if(isExtentFile)
+	{
+		// one free per extent instead of one per block
+		deleteExtents(currentInode);
+	}
+	else if(isLargeFile)
 	{
-		// Single Indirection 
-		for(i=0;i<len(currentInode.addr) - 1 && currentInode.addr[i] !=0;i++)
+		// copies of the indirection blocks, one per level, on the heap: a block may be 64 KB
+		unsigned int *sib = malloc(3 * BLOCK_SIZE);
+		unsigned int *sib1 = sib; // first level of triple indirection
+		unsigned int *sib2 = sib + NUMBER_OF_BLOCKS_PER_INDIRECTION; // second level of triple indirection
+		unsigned int *sib3 = sib + 2 * NUMBER_OF_BLOCKS_PER_INDIRECTION; // third level of triple indirection
+
+		// Single Indirection, an indirection block of a sparse file may be missing (hole)
+		for(i=0;i<len(currentInode->addr) - 1;i++)
 		{
-			singleIndirectionblockNumber = currentInode.addr[i];
-			singleIndirectblock_t sib;
-			lseek(fd,BLOCK_POSITION(singleIndirectionblockNumber),SEEK_SET);
-			read(fd,&sib,sizeof(sib));
+			if(currentInode->addr[i] == 0)
+				continue;
+			singleIndirectionblockNumber = currentInode->addr[i];
+			readBlock(singleIndirectionblockNumber,sib,BLOCK_SIZE);
 			
 			// read all the block numbers from the single indirection block and add it to free list
-			for(j=0;j<len(sib.blockNumbers);j++)
+			for(j=0;j<NUMBER_OF_BLOCKS_PER_INDIRECTION;j++)
 			{
-				if(sib.blockNumbers[j]!=0)
-					add_to_free_list(sib.blockNumbers[j]);
+				if(sib[j]!=0)
+					add_to_free_list(sib[j]);
 			}
-			add_to_free_list(currentInode.addr[i]);
-			currentInode.addr[i] = 0;
+			add_to_free_list(currentInode->addr[i]);
+			currentInode->addr[i] = 0;
 		}
 
 		// Triple Indirection
-		if(currentInode.addr[len(currentInode.addr) - 1] != 0)
+		if(currentInode->addr[len(currentInode->addr) - 1] != 0)
 		{
 			// Read the last block of addr[] 
-			singleIndirectblock_t sib1; // first level of triple indirection
-			lseek(fd,BLOCK_POSITION(currentInode.addr[len(currentInode.addr) - 1]),SEEK_SET);
-			read(fd,&sib1,sizeof(sib1));
+			readBlock(currentInode->addr[len(currentInode->addr) - 1],sib1,BLOCK_SIZE);
 			
-			for(i=0;i<len(sib1.blockNumbers);i++)
+			for(i=0;i<NUMBER_OF_BLOCKS_PER_INDIRECTION;i++)
 			{
-				if(sib1.blockNumbers[i]!=0)
+				if(sib1[i]!=0)
 				{
-					singleIndirectblock_t sib2; // second level of triple indirection
-					lseek(fd,BLOCK_POSITION(sib1.blockNumbers[i]),SEEK_SET);
-					read(fd,&sib2,sizeof(sib2));
+					readBlock(sib1[i],sib2,BLOCK_SIZE);
 					
-					for(j=0;j<len(sib2.blockNumbers);j++)
+					for(j=0;j<NUMBER_OF_BLOCKS_PER_INDIRECTION;j++)
 					{
-						if(sib2.blockNumbers[j]!=0)
+						if(sib2[j]!=0)
 						{
-							singleIndirectblock_t sib3; // third level of triple indirection
-							lseek(fd,BLOCK_POSITION(sib2.blockNumbers[j]),SEEK_SET);
-							read(fd,&sib3,sizeof(sib3));
+							readBlock(sib2[j],sib3,BLOCK_SIZE);
 
-							for(k=0;k<len(sib3.blockNumbers);k++)
+							for(k=0;k<NUMBER_OF_BLOCKS_PER_INDIRECTION;k++)
 							{
-								if(sib3.blockNumbers[k]!=0)
-									add_to_free_list(sib3.blockNumbers[k]);
+								if(sib3[k]!=0)
+									add_to_free_list(sib3[k]);
 							}
-							add_to_free_list(sib2.blockNumbers[j]);
+							add_to_free_list(sib2[j]);
 						}
 					}
-					add_to_free_list(sib1.blockNumbers[i]);
+					add_to_free_list(sib1[i]);
 				}
 			}
+			add_to_free_list(currentInode->addr[len(currentInode->addr) - 1]);
+			currentInode->addr[len(currentInode->addr) - 1] = 0;
 		}
+		free(sib);
 	}
 	else
 	{
-		for(i=0;i<len(currentInode.addr) && currentInode.addr[i] !=0;i++)
+		for(i=0;i<len(currentInode->addr);i++)
 		{
-			add_to_free_list(currentInode.addr[i]);
-			DEBUG_LOG("\nAdding %d to free list",currentInode.addr[i]) ;
-			currentInode.addr[i] = 0;
+			if(currentInode->addr[i] == 0) // hole
+				continue;
+			add_to_free_list(currentInode->addr[i]);
+			DEBUG_LOG("\nAdding %d to free list",currentInode->addr[i]) ;
+			currentInode->addr[i] = 0;
 		}
 	}
 
 	//Updating file size to 0
-	currentInode.flags = 0;
-	currentInode.size0 = 0;
-	currentInode.size1 = 0;
+	currentInode->flags = 0;
+	setInodeSize(currentInode,0);
 
-	lseek(fd,INODE_POSITION(inode_number),SEEK_SET);
-	write(fd,&currentInode,sizeof(currentInode));
+	imarkdirty(currentInode);
+	iput(currentInode);
 	 
 	//Add to free i-list
 	add_free_inode(inode_number);
 }
 
+/***********************************************************************
+ Orphan files:
+	rm unlinks a file right away but leaves freeing its blocks for later,
+	so deleting a large file does not hold up the command loop. The inode
+	stays allocated, flagged as an orphan (bit 10) and chained from
+	esb.orphanHead through its modtime[], which is saved with the inode
+	and the extended super block, so the list survives q and load.
+	After every command reclaimOrphans frees up to ORPHAN_SLICE_BLOCKS
+	blocks from the end of the first orphan (see bmapTruncate) and
+	shrinks its size, the inode is freed once the size reaches zero.
+	When the disk runs out of blocks or inodes the orphans are reclaimed
+	completely before the allocation fails.
+***********************************************************************/
+
+/* Unlinks the file, small files are freed at once, larger ones are put on the orphan list */
+void orphanFile(int inode_number)
+{
+	inode_t *fileInode = iget(inode_number);
+	unsigned long long size = inodeSize(fileInode);
+	if((size + BLOCK_SIZE - 1) / BLOCK_SIZE <= ORPHAN_SLICE_BLOCKS)
+	{
+		iput(fileInode);
+		deleteFile(inode_number);
+		return;
+	}
+
+	fileInode->flags = fileInode->flags | (1 << 10); // orphan
+	fileInode->nlinks = 0;
+	fileInode->modtime[0] = esb.orphanHead >> 16;
+	fileInode->modtime[1] = esb.orphanHead & (256*256 -1);
+	imarkdirty(fileInode);
+	iput(fileInode);
+
+	esb.orphanHead = inode_number;
+	esb.orphans++;
+	sb.fmod = 1;
+}
+
+/* Frees up to budget data blocks of the orphan files, the first orphan from its end */
+void reclaimOrphans(unsigned int budget)
+{
+	static int reclaiming = 0; // the allocators call in when the disk is full
+	if(reclaiming)
+		return;
+	reclaiming = 1;
+
+	while(esb.orphanHead != 0 && budget > 0)
+	{
+		int inode_number = esb.orphanHead;
+		blockmap_t map;
+		bmapOpen(&map,inode_number);
+		inode_t *fileInode = map.inode;
+		unsigned int blocks = (inodeSize(fileInode) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		unsigned int keep = blocks > budget ? blocks - budget : 0;
+
+		bmapTruncate(&map,blocks,keep);
+		budget -= blocks - keep;
+		setInodeSize(fileInode,(unsigned long long)keep * BLOCK_SIZE);
+		imarkdirty(fileInode);
+		unsigned int next = fileInode->modtime[0] << 16 | fileInode->modtime[1];
+		bmapClose(&map);
+
+		if(keep == 0)
+		{
+			// take the orphan off the list and free what is left of it, the inode included
+			esb.orphanHead = next;
+			esb.orphans--;
+			sb.fmod = 1;
+			deleteFile(inode_number);
+		}
+	}
+	reclaiming = 0;
+}
+
 //Splits and returns the last part of the filepath
 char* getfileName(char* filePath)
 {
@@ -1366,7 +4137,46 @@ void listDir()
 		if(list[i].isDirectory)
 			printf("\n %s\t dir",list[i].name);
 		else
-			printf("\n %s\t file \t %d",list[i].name,list[i].fileSize);
+			printf("\n %s\t file \t %llu",list[i].name,list[i].fileSize);
+	}
+	free(list);
+}
+
+/* Reads up to size bytes from the file, returns less only at the end of the file */
+int readFully(int filedes,char *buffer,int size)
+{
+	int total = 0;
+	int bytesRead;
+	while(total < size && (bytesRead = read(filedes,buffer + total,size - total)) > 0)
+		total += bytesRead;
+	return total;
+}
+
+/* Writes size bytes of buffer to the given data blocks, blocks[i] receives the i-th BLOCK_SIZE piece.
+   Physically adjacent blocks are written with a single write, pieces whose block is 0 (holes) are not written */
+void writeBlockRuns(unsigned int *blocks,int noOfBlocks,char *buffer,int size)
+{
+	int i = 0;
+	while(i < noOfBlocks)
+	{
+		if(blocks[i] == 0)
+		{
+			i++;
+			continue;
+		}
+		int runLength = 1;
+		while(i + runLength < noOfBlocks && blocks[i + runLength] == blocks[i] + runLength)
+			runLength++;
+
+		int bytesToWrite = runLength * BLOCK_SIZE;
+		if(i * BLOCK_SIZE + bytesToWrite > size) // last block of the file may be partial
+			bytesToWrite = size - i * BLOCK_SIZE;
+
+		int j;
+		for(j=0;j<runLength;j++)
+			binval(blocks[i] + j); // drop stale cached copies, the disk is written directly
+		pwrite(fd,buffer + i * BLOCK_SIZE,bytesToWrite,BLOCK_POSITION((off_t)blocks[i]));
+		i += runLength;
 	}
 }
 
@@ -1381,10 +4191,6 @@ void cpin(char* args)
 	char* extfileName;
 	char* v6fileName;
 
-	// reads the external file and writes 1 byte at a time using read buffer
-	char readbuffer;
-	
-
 	//split the arguments by space to get v6 file path and ext file path
 	args = strtok(NULL,delimiter);
 
@@ -1413,10 +4219,19 @@ void cpin(char* args)
 		return;
 	}
 
+	// the size of the external file must fit in the inode
+	struct stat extStat;
+	if(fstat(efd,&extStat) == 0 && (unsigned long long)extStat.st_size > maxFileSize())
+	{
+		printf("File %s is larger than %llu bytes, the largest file of this file system",extfileName,maxFileSize());
+		close(efd);
+		return;
+	}
+
 	char *targetFileName, *v6filePath;
 	
 	//copying v6 filepath to a temp variable
-	v6filePath =  malloc(sizeof(v6fileName));
+	v6filePath =  malloc(strlen(v6fileName) + 1);
 	strcpy(v6filePath,v6fileName);
 	
 	//Gets the last part of the v6 filepath. (delimited by '/')
@@ -1442,110 +4257,233 @@ void cpin(char* args)
 		if(inode_number == -1)
 		{
 			printf("Invalid v6 file path. Create directory path using mkdir and try again!");
+			close(efd);
 			return;
 		}
 		
 			// Check if it is a directory
-			lseek(fd,INODE_POSITION(inode_number),SEEK_SET);
-			read(fd,&fileInode,sizeof(fileInode));
+			readInode(inode_number,&fileInode);
 			isDirectory = ((fileInode.flags & (1 << 14)) >> 14); // 2nd bit
 			
 			if(isDirectory)
 			{
 				printf("Error! Directory exists with the same name!");
+				close(efd);
 				return;
 			}
 
 		printf("File %s already exist. Overwriting file...",targetFileName);
 		deleteDirectoryEntry(parent_inode_number,inode_number);
-		deleteFile(inode_number);
+		orphanFile(inode_number);
 	}
 	
 	//Create Inode for the file
 	inode_number = get_free_inode();
-	lseek(fd,INODE_POSITION(inode_number),SEEK_SET);
-	read(fd,&fileInode,sizeof(fileInode));
-	
-
-	fileInode.flags = fileInode.flags | (1 << 15); // set allocation
-	fileInode.flags = fileInode.flags & (0 << 14); // set as file
+	if(inode_number == 0)
+	{
+		printf("No more inodes to allocate!");
+		close(efd);
+		return;
+	}
+	inode_t *newFileInode = iget(inode_number); // held until the copy is complete
+
+	newFileInode->flags = newFileInode->flags | (1 << 15); // set allocation
+	newFileInode->flags = newFileInode->flags & ~(1 << 14); // set as file
+	newFileInode->flags = newFileInode->flags & ~(1 << 12); // small file until it outgrows addr[]
+	newFileInode->flags = newFileInode->flags & ~(1 << 13); // not inline until the whole file is known to fit
+	if(esb.features & FEATURE_EXTENTS)
+		newFileInode->flags = newFileInode->flags | (1 << 11); // blocks are mapped by extents
+	else
+		newFileInode->flags = newFileInode->flags & ~(1 << 11);
 
-	//set size as 0
-	fileInode.size0 = 0;
-	fileInode.size1 = 0;
-	
+	//set size as 0 and clear the block addresses left behind by a previous owner of the inode
+	setInodeSize(newFileInode,0);
+	int j;
+	for(j=0;j<len(newFileInode->addr);j++)
+		newFileInode->addr[j] = 0;
 	
-	lseek(fd,INODE_POSITION(inode_number),SEEK_SET);
-	write(fd,&fileInode,sizeof(fileInode));
+	imarkdirty(newFileInode);
 	
 	int bytesRead = 0;
-	int bytesWrittenPerBlock = 0;
-	int blockNumber;
-	int fileSize = 0;
-	 
-	
-	int isLargeFile = 0; 
+	unsigned long long fileSize = 0;
+	int diskFull = 0;
+
+	// reads the external file IO_CHUNK_BLOCKS blocks at a time
+	char *chunk = malloc(IO_CHUNK_BLOCKS * BLOCK_SIZE);
+	unsigned int chunkBlocks[IO_CHUNK_BLOCKS];
+
+	// append cursor, keeps the indirection blocks being filled in memory for the whole copy
+	blockmap_t map;
+	bmapOpen(&map,inode_number);
+
+	// the size of the external file is known, data blocks are reserved in contiguous runs
+	// as long as the rest of the file (see get_free_blocks)
+	unsigned int blocksLeft = 0;
+	unsigned int runStart = 0, runLength = 0;
+	if(fstat(efd,&extStat) == 0)
+		blocksLeft = (extStat.st_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
 	// Write contents of the file into data blocks and add it to inode 
-		// reads the external file and writes 1 byte at a time using read buffer
-	while(bytesRead = read(efd,&readbuffer,sizeof(readbuffer)))
+	while(!diskFull && (bytesRead = readFully(efd,chunk,IO_CHUNK_BLOCKS * BLOCK_SIZE)) > 0)
 	{
-		int offset;
-		
-		offset = fileSize % BLOCK_SIZE;
-		
-		//when the current blocks becomes full
-		if(bytesWrittenPerBlock == 0)
-		{
-			//Get a free block
-			blockNumber = get_free_block();
-			DEBUG_LOG("\n Writing to block number %d, %d",blockNumber ,fileInode.size1);
-			if(blockNumber)
-				addDataBlockToInode(inode_number,blockNumber); // Adding the block to addr[] based on the file size
+		if(fileSize == 0 && bytesRead <= INLINE_DATA_SIZE)
+		{
+			// the whole file (a short read is the end of it) fits in the inode, no data block is used
+			memcpy(newFileInode->addr,chunk,bytesRead);
+			newFileInode->flags = newFileInode->flags | (1 << 13); // inline data
+			newFileInode->flags = newFileInode->flags & ~(1 << 11);
+			fileSize = bytesRead;
+			break;
+		}
+
+		int noOfBlocks = (bytesRead + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		int logicalBlockNumber = fileSize / BLOCK_SIZE;
+		int i;
+
+		//Allocate a data block for every block of the chunk and add it to addr[]
+		for(i=0;i<noOfBlocks;i++)
+		{
+			int blockBytes = bytesRead - i * BLOCK_SIZE < BLOCK_SIZE ? bytesRead - i * BLOCK_SIZE : BLOCK_SIZE;
+			if(blockIsZero(chunk + i * BLOCK_SIZE,blockBytes))
+			{
+				// all zeros: leave a hole, no block is allocated or written and the block reads back as zeros
+				chunkBlocks[i] = 0;
+				if(blocksLeft > 0)
+					blocksLeft--;
+				holeBlocks++; // counted for stats
+				// a block-mapped file keeps the 0 pointer, an extent-mapped file records the hole as an extent
+				if(!(newFileInode->flags & (1 << 11)) || bmapAppend(&map,logicalBlockNumber + i,0))
+					continue;
+				printf("No more blocks to allocate! File truncated to %llu bytes",fileSize + i * BLOCK_SIZE);
+				diskFull = 1;
+				break;
+			}
+			if(runLength == 0)
+			{
+				runStart = get_free_blocks(blocksLeft > 1 ? blocksLeft : 1,&runLength);
+				if(runStart == 0)
+					runLength = 0;
+			}
+			if(runLength > 0)
+			{
+				chunkBlocks[i] = runStart++;
+				runLength--;
+				if(blocksLeft > 0)
+					blocksLeft--;
+			}
 			else
-				return;
-  		}
-		
-			
-		lseek(fd,BLOCK_POSITION(blockNumber) + offset,SEEK_SET);
-		write(fd,&readbuffer,sizeof(readbuffer));
+				chunkBlocks[i] = 0;
+			DEBUG_LOG("\n Writing to block number %d",chunkBlocks[i]);
+			// an indirection block may be needed when the disk is full, give it the end of the reserved run
+			while(chunkBlocks[i] != 0 && !bmapAppend(&map,logicalBlockNumber + i,chunkBlocks[i]))
+			{
+				if(runLength == 0)
+				{
+					add_to_free_list(chunkBlocks[i]);
+					chunkBlocks[i] = 0;
+				}
+				else
+					add_to_free_list(runStart + --runLength);
+			}
+			if(chunkBlocks[i] == 0)
+			{
+				printf("No more blocks to allocate! File truncated to %llu bytes",fileSize + i * BLOCK_SIZE);
+				diskFull = 1;
+				break;
+			}
+		}
+		if(i < noOfBlocks)
+		{
+			noOfBlocks = i;
+			bytesRead = noOfBlocks * BLOCK_SIZE;
+		}
+
+		// write the chunk, one write per run of physically adjacent blocks
+		writeBlockRuns(chunkBlocks,noOfBlocks,chunk,bytesRead);
 		fileSize += bytesRead;
 
-		// To reset the offset and check if the current block is full, bytesWrittenPerBlock becomes 0 when the current block is full
-		bytesWrittenPerBlock = (bytesWrittenPerBlock + bytesRead) % BLOCK_SIZE;
-	
-		lseek(fd,INODE_POSITION(inode_number),SEEK_SET);
-		read(fd,&fileInode,sizeof(fileInode));
-		
-		fileInode.size0 = fileSize >> 16;
-		fileInode.size1 = fileSize & (256*256 -1);
-	
-		lseek(fd,INODE_POSITION(inode_number),SEEK_SET);
-		write(fd,&fileInode,sizeof(fileInode));
+		//update file size once per chunk
+		setInodeSize(newFileInode,fileSize);
+		imarkdirty(newFileInode);
+	}
+	bmapClose(&map);
+	free(chunk);
+	close(efd);
+
+	// return the reserved blocks the file did not use (it was truncated or shrank while copying)
+	while(runLength > 0)
+	{
+		add_to_free_list(runStart++);
+		runLength--;
 	}
 
-	lseek(fd,INODE_POSITION(inode_number),SEEK_SET);
-	read(fd,&fileInode,sizeof(fileInode));
-	
 	//update file size
-	fileInode.size0 = fileSize >> 16;
-	fileInode.size1 = fileSize & (256*256 -1);
+	setInodeSize(newFileInode,fileSize);
 
 	time_t sec;
 	sec = time(NULL);
 
-	//Update modified time
-	fileInode.acttime[0] = sec >> 16;
-	fileInode.acttime[1] = sec & (256*256 -1); 
+	//Update modified time, acttime[] holds the high bits of the size of a large file
+	if(!(esb.features & FEATURE_LARGE_FILES))
+	{
+		newFileInode->acttime[0] = sec >> 16;
+		newFileInode->acttime[1] = sec & (256*256 -1); 
+	}
+
+	newFileInode->modtime[0] = sec >> 16;
+	newFileInode->modtime[1] = sec & (256 * 256 -1); 
+
+	imarkdirty(newFileInode);
+	iput(newFileInode);
+	
+	add_directoryEntry_to_parentDir(targetFileName,parent_inode_number,inode_number);
+}
+
+
+/* Copies size bytes starting at the given data block to the external file at outOffset.
+   Uses copy_file_range so the data stays in the kernel, falls back to positional read/write
+   when the two files cannot be copied between (e.g. different file systems) */
+int copyBlockRunOut(int efd,int blockNumber,off_t size,off_t outOffset)
+{
+	static int copyRangeUnsupported = 0;
+	off_t inOffset = BLOCK_POSITION((off_t)blockNumber);
 
-	fileInode.modtime[0] = sec >> 16;
-	fileInode.modtime[1] = sec & (256 * 256 -1); 
+	// the disk is read directly, write back modified cached copies first
+	bflushBlocks(blockNumber,(size + BLOCK_SIZE - 1) / BLOCK_SIZE);
 
-	lseek(fd,INODE_POSITION(inode_number),SEEK_SET);
-	write(fd,&fileInode,sizeof(fileInode));
-	
-	add_directoryEntry_to_parentDir(targetFileName,parent_inode_number,inode_number);
-}
+	while(size > 0 && !copyRangeUnsupported)
+	{
+		ssize_t copied = copy_file_range(fd,&inOffset,efd,&outOffset,size,0);
+		if(copied > 0)
+		{
+			size -= copied;
+			continue;
+		}
+		if(copied == 0)
+			return -1;
+		if(errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP)
+			copyRangeUnsupported = 1;
+		else
+			return -1;
+	}
 
+	char *buffer = size > 0 ? malloc(IO_CHUNK_BLOCKS * BLOCK_SIZE) : NULL;
+	while(size > 0)
+	{
+		int bytesToCopy = size < IO_CHUNK_BLOCKS * BLOCK_SIZE ? (int)size : IO_CHUNK_BLOCKS * BLOCK_SIZE;
+		int bytesRead = pread(fd,buffer,bytesToCopy,inOffset);
+		if(bytesRead <= 0 || pwrite(efd,buffer,bytesRead,outOffset) != bytesRead)
+		{
+			free(buffer);
+			return -1;
+		}
+		size -= bytesRead;
+		inOffset += bytesRead;
+		outOffset += bytesRead;
+	}
+	free(buffer);
+	return 0;
+}
 
 /***************************************************************
  * Function to copy from v6 to external file
@@ -1558,9 +4496,6 @@ void cpout(char* args)
 	char* extfileName;
 	char* v6fileName;
 
-	// reads the external file and writes 1 byte at a time using read buffer
-	char readBuffer;
-
 	int parent_inode_number = 1;
 
 	//split the arguments by space to get v6 file path and ext file path
@@ -1581,7 +4516,7 @@ void cpout(char* args)
 	extfileName = args;
 	int efd =0;
 
-	efd = creat(extfileName,2); //read-write mode
+	efd = open(extfileName,O_WRONLY | O_CREAT | O_TRUNC,0644);
 
 	if(efd<0)
 	{
@@ -1591,7 +4526,7 @@ void cpout(char* args)
 	
 	char *fileName, *v6filePath;
 	
-	v6filePath =  malloc(sizeof(v6fileName));
+	v6filePath =  malloc(strlen(v6fileName) + 1);
 	strcpy(v6filePath,v6fileName);
 	
 	// Gets the last part of the passed argument, file name of the v6
@@ -1616,283 +4551,614 @@ void cpout(char* args)
 	inode_t fileInode;
 	
 	//Read the file
-	lseek(fd,INODE_POSITION(found_inode),SEEK_SET);
-	read(fd,&fileInode,sizeof(fileInode));
-	char buffer;
-	int bytesToRead = fileInode.size0 << 16 | fileInode.size1;
-	int fileOffset = 0;
+	readInode(found_inode,&fileInode);
+	unsigned long long bytesToRead = inodeSize(&fileInode);
+	unsigned long long fileOffset = 0;
+
+	// inline data, the contents are in the inode
+	if(fileInode.flags & (1 << 13))
+	{
+		if(pwrite(efd,fileInode.addr,bytesToRead,0) != (ssize_t)bytesToRead)
+			printf("Error writing to external file %s",extfileName);
+		close(efd);
+		return;
+	}
+
+	blockmap_t map;
+	bmapOpen(&map,found_inode);
 
+	// Collect runs of physically contiguous blocks and copy every run to the external file in one go
 	while(bytesToRead) // Total file size left to read
 	{
-			int blockNumber = getBlockToRead(fileOffset,found_inode);
-			DEBUG_LOG("\n reading from block number %d ",blockNumber);
-			// Read from the block and write to file
-			lseek(fd,BLOCK_POSITION(blockNumber),SEEK_SET);
+		unsigned int blockNumber = bmap(&map,fileOffset/BLOCK_SIZE);
+		int runLength = 1;
+		DEBUG_LOG("\n reading from block number %u ",blockNumber);
 
-			int bytesToReadPerBlock = BLOCK_SIZE;
-			//Read the block till BLOCK_SIZE
-			while(bytesToRead && bytesToReadPerBlock)
-			{
-				int bytesRead = read(fd,&buffer,sizeof(buffer));
-				write(efd,&buffer,sizeof(buffer));
-				bytesToRead -= bytesRead;
-				bytesToReadPerBlock -=bytesRead;
-				fileOffset +=bytesRead;
-			}
+		// a run of holes (block 0) is skipped, it reads as zeros in the external file as well
+		while((unsigned long long)runLength * BLOCK_SIZE < bytesToRead
+				&& bmap(&map,fileOffset/BLOCK_SIZE + runLength) == (blockNumber ? blockNumber + runLength : 0))
+			runLength++;
+
+		unsigned long long bytesInRun = (unsigned long long)runLength * BLOCK_SIZE;
+		if(bytesInRun > bytesToRead) // last block of the file may be partial
+			bytesInRun = bytesToRead;
+
+		if(blockNumber == 0)
+		{
+			bytesToRead -= bytesInRun;
+			fileOffset += bytesInRun;
+			continue;
+		}
+		if(copyBlockRunOut(efd,blockNumber,bytesInRun,fileOffset) < 0)
+		{
+			printf("Error writing to external file %s",extfileName);
+			break;
+		}
+		bytesToRead -= bytesInRun;
+		fileOffset += bytesInRun;
 	}	
 	
+	bmapClose(&map);
+	// a file ending in a hole gets its size from the truncate
+	ftruncate(efd,(off_t)inodeSize(&fileInode));
 	close(efd);
 }
 
-//Gets the block from file-inode based on the offset
-int getBlockToRead(int offset,int inode_number)
+/***********************************************************************
+ Block map cursor:
+	Maps logical blocks of a file to disk blocks. The cursor holds the
+	inode and keeps the indirection blocks of the last lookup pinned in
+	the buffer cache, one per level. A lookup only reads the levels whose
+	indirection block differs from the pinned one, so a sequential scan
+	reads one indirection block per NUMBER_OF_BLOCKS_PER_INDIRECTION
+	data blocks.
+	bmapAppend extends the file through the same pinned blocks, an
+	indirection block is marked for write back once, when the cursor
+	moves past it or is closed, instead of once per appended block.
+***********************************************************************/
+
+/* Opens a cursor on the file */
+void bmapOpen(blockmap_t *map,int inode_number)
 {
-	inode_t fileInode;
 	int i;
-	lseek(fd,INODE_POSITION(inode_number),SEEK_SET);
-	read(fd,&fileInode,sizeof(fileInode));
-	short isLargeFile = ((fileInode.flags & (1 << 12)) >> 12);
+	map->inode_number = inode_number;
+	map->inode = iget(inode_number);
+	map->extentIndex = -1;
+	map->extentTail = -2;
+	map->extentBase = 0;
+	for(i=0;i<len(map->level);i++)
+	{
+		map->level[i] = NULL;
+		map->levelDirty[i] = 0;
+	}
+}
 
-	DEBUG_LOG("\n Get Block to read, Offest %d ",offset);
-	int logicalBlockNumber = offset/BLOCK_SIZE;
+// Unpins the indirection block of the level, writing it back if it was changed
+void bmapRelease(blockmap_t *map,int level)
+{
+	if(map->level[level])
+	{
+		if(map->levelDirty[level])
+			bdwrite(map->level[level]);
+		else
+			brelse(map->level[level]);
+	}
+	map->level[level] = NULL;
+	map->levelDirty[level] = 0;
+}
 
-	if(!isLargeFile) // small file
+/* Returns the block numbers stored in the indirection block, pinning it as the given level of the cursor */
+unsigned int* bmapLevel(blockmap_t *map,int level,unsigned int blockNumber)
+{
+	if(map->level[level] == NULL || map->level[level]->blkno != blockNumber)
 	{
-		return fileInode.addr[logicalBlockNumber];
+		bmapRelease(map,level);
+		map->level[level] = bread(blockNumber);
 	}
-	else // large file
+	return (unsigned int*)map->level[level]->data;
+}
+
+/* Allocates an empty indirection block and pins it as the given level, returns 0 if the disk is full */
+unsigned int bmapNewLevel(blockmap_t *map,int level)
+{
+	unsigned int blockNumber = get_free_block();
+	if(blockNumber == 0)
+		return 0;
+	bmapRelease(map,level);
+	map->level[level] = getblk(blockNumber);
+	clrbuf(map->level[level]);
+	map->levelDirty[level] = 1;
+	return blockNumber;
+}
+
+/* Returns the indirection block the entry of the parent points to, allocating it when the entry is empty */
+unsigned int* bmapAppendLevel(blockmap_t *map,int level,unsigned int *parentEntry,int *parentDirty)
+{
+	if(*parentEntry == 0)
 	{
-		DEBUG_LOG("\n\t Large file read, logicalBlockNumber %d ",logicalBlockNumber);
-		
-		int singleIndirectionblockNumber = (logicalBlockNumber/NUMBER_OF_BLOCKS_PER_INDIRECTION);
-		DEBUG_LOG("\n\t single Indirection logical block Number :%d ",singleIndirectionblockNumber);
-		
-		//First ten blocks are single indirection blocks
-		if(singleIndirectionblockNumber < len(fileInode.addr)-1)
+		if((*parentEntry = bmapNewLevel(map,level)) == 0)
+			return NULL;
+		*parentDirty = 1;
+		return (unsigned int*)map->level[level]->data;
+	}
+	return bmapLevel(map,level,*parentEntry);
+}
+
+/* Adds the data block as the given logical block, the end of the file.
+   Returns 0 if an indirection block could not be allocated or the file reached its maximum size */
+int bmapAppend(blockmap_t *map,int logicalBlockNumber,int blockNumber)
+{
+	inode_t *fileInode = map->inode;
+	short isLargeFile = ((fileInode->flags & (1 << 12)) >> 12);
+	int inodeDirty = 0;
+	unsigned int *entries;
+
+	if(fileInode->flags & (1 << 11)) // extent-mapped
+		return bmapExtentAppend(map,blockNumber);
+
+	if(!isLargeFile)
+	{
+		if(logicalBlockNumber < len(fileInode->addr))
 		{
-			singleIndirectblock_t sib;
-			lseek(fd,BLOCK_POSITION(fileInode.addr[singleIndirectionblockNumber]),SEEK_SET);
-			read(fd,&sib,sizeof(sib));
-			return sib.blockNumbers[logicalBlockNumber%NUMBER_OF_BLOCKS_PER_INDIRECTION];
+			fileInode->addr[logicalBlockNumber] = blockNumber;
+			imarkdirty(fileInode);
+			return 1;
 		}
-		else{ // triple indirection
-			
-			//Any logical number greater than 10 will present inside the last position of addr[] in triple indirection
-			singleIndirectionblockNumber = len(fileInode.addr) -1;
-			singleIndirectblock_t sib1;
+		if(!makeLargefile(map->inode_number))
+			return 0;
+	}
 
-			//travesrsing through triple indirection
-			lseek(fd,BLOCK_POSITION(fileInode.addr[len(fileInode.addr)-1]),SEEK_SET);
-			read(fd,&sib1,sizeof(sib1));
+	int singleIndirectionblockNumber = (logicalBlockNumber/NUMBER_OF_BLOCKS_PER_INDIRECTION);
+	DEBUG_LOG("\n\tLarge file additon, logical block %d",logicalBlockNumber);
 
-			int remainingBlocks = logicalBlockNumber - (NUMBER_OF_BLOCKS_PER_INDIRECTION * (len(fileInode.addr)-1));
-			int tripleIndirectionLogicalBlockNumber = (remainingBlocks/(NUMBER_OF_BLOCKS_PER_INDIRECTION
-																	         *NUMBER_OF_BLOCKS_PER_INDIRECTION));
-			int tripleIndirectionBlockNumber = sib1.blockNumbers[tripleIndirectionLogicalBlockNumber];
+	//First ten blocks are single indirection blocks
+	if(singleIndirectionblockNumber < len(fileInode->addr) - 1)
+	{
+		entries = bmapAppendLevel(map,2,&fileInode->addr[singleIndirectionblockNumber],&inodeDirty);
+	}
+	else
+	{
+		// triple indirection, addr[10] -> first level -> second level -> third level -> data block
+		int remainingBlocks = logicalBlockNumber - (NUMBER_OF_BLOCKS_PER_INDIRECTION * (len(fileInode->addr)-1));
+		int tripleIndirectionLogicalBlockNumber = remainingBlocks/(NUMBER_OF_BLOCKS_PER_INDIRECTION*NUMBER_OF_BLOCKS_PER_INDIRECTION);
+		int doubleIndirectionLogicalBlockNumber = (remainingBlocks/NUMBER_OF_BLOCKS_PER_INDIRECTION)%NUMBER_OF_BLOCKS_PER_INDIRECTION;
 
-			//travesrsing through double indirection
-			singleIndirectblock_t sib2;
-			lseek(fd,BLOCK_POSITION(tripleIndirectionBlockNumber),SEEK_SET);
-			read(fd,&sib2,sizeof(sib2));
+		if(tripleIndirectionLogicalBlockNumber >= NUMBER_OF_BLOCKS_PER_INDIRECTION)
+		{
+			printf("MAX File size reached!");
+			return 0;
+		}
 
-			int doubleIndirectionLogicalBlockNumber = (remainingBlocks/NUMBER_OF_BLOCKS_PER_INDIRECTION);
-			int doubleIndirectionBlockNumber = sib2.blockNumbers[doubleIndirectionLogicalBlockNumber];
+		entries = bmapAppendLevel(map,0,&fileInode->addr[len(fileInode->addr)-1],&inodeDirty);
+		if(entries)
+			entries = bmapAppendLevel(map,1,&entries[tripleIndirectionLogicalBlockNumber],&map->levelDirty[0]);
+		if(entries)
+			entries = bmapAppendLevel(map,2,&entries[doubleIndirectionLogicalBlockNumber],&map->levelDirty[1]);
+	}
 
-			//travesrsing through single indirection
-			singleIndirectblock_t sib3;
-			lseek(fd,BLOCK_POSITION(doubleIndirectionBlockNumber),SEEK_SET);
-			read(fd,&sib3,sizeof(sib3));
+	if(inodeDirty)
+		imarkdirty(fileInode);
+	if(entries == NULL)
+		return 0;
 
-			
-			int singleIndirectionBlockNumber = (remainingBlocks%NUMBER_OF_BLOCKS_PER_INDIRECTION);
-			return sib3.blockNumbers[singleIndirectionBlockNumber];
-		}
+	entries[logicalBlockNumber%NUMBER_OF_BLOCKS_PER_INDIRECTION] = blockNumber;
+	map->levelDirty[2] = 1;
+	return 1;
+}
+
+/* Returns the disk block holding the logical block of the file, 0 if it is not allocated */
+unsigned int bmap(blockmap_t *map,int logicalBlockNumber)
+{
+	inode_t *fileInode = map->inode;
+	short isLargeFile = ((fileInode->flags & (1 << 12)) >> 12);
+
+	if(fileInode->flags & (1 << 13)) // inline data, no blocks
+		return 0;
+
+	if(fileInode->flags & (1 << 11)) // extent-mapped
+		return bmapExtent(map,logicalBlockNumber);
+
+	if(!isLargeFile) // small file
+	{
+		if(logicalBlockNumber >= len(fileInode->addr)) // past the end of addr[], not allocated yet
+			return 0;
+		return fileInode->addr[logicalBlockNumber];
+	}
+
+	int singleIndirectionblockNumber = (logicalBlockNumber/NUMBER_OF_BLOCKS_PER_INDIRECTION);
 
+	//First ten blocks are single indirection blocks
+	if(singleIndirectionblockNumber < len(fileInode->addr)-1)
+	{
+		if(fileInode->addr[singleIndirectionblockNumber] == 0)
+			return 0;
+		return bmapLevel(map,2,fileInode->addr[singleIndirectionblockNumber])[logicalBlockNumber%NUMBER_OF_BLOCKS_PER_INDIRECTION];
 	}
+
+	// triple indirection, addr[10] -> first level -> second level -> third level -> data block
+	int remainingBlocks = logicalBlockNumber - (NUMBER_OF_BLOCKS_PER_INDIRECTION * (len(fileInode->addr)-1));
+	unsigned int blockNumber = fileInode->addr[len(fileInode->addr)-1];
+
+	if(blockNumber == 0)
+		return 0;
+	blockNumber = bmapLevel(map,0,blockNumber)[remainingBlocks/(NUMBER_OF_BLOCKS_PER_INDIRECTION*NUMBER_OF_BLOCKS_PER_INDIRECTION)];
+	if(blockNumber == 0)
+		return 0;
+	blockNumber = bmapLevel(map,1,blockNumber)[(remainingBlocks/NUMBER_OF_BLOCKS_PER_INDIRECTION)%NUMBER_OF_BLOCKS_PER_INDIRECTION];
+	if(blockNumber == 0)
+		return 0;
+	return bmapLevel(map,2,blockNumber)[remainingBlocks%NUMBER_OF_BLOCKS_PER_INDIRECTION];
 }
 
-//Adds the block to end of the file inode
-void addDataBlockToInode(int inode_number,int blockNumber)
+/* Releases the pinned indirection blocks and the inode */
+void bmapClose(blockmap_t *map)
 {
-	inode_t fileInode;
-	lseek(fd,INODE_POSITION(inode_number),SEEK_SET);
-	read(fd,&fileInode,sizeof(fileInode));
+	int i;
+	for(i=0;i<len(map->level);i++)
+		bmapRelease(map,i);
+	iput(map->inode);
+}
 
-	int logicalBlockNumber;
-	
-	 int i;
-	short isLargeFile = ((fileInode.flags & (1 << 12)) >> 12);
-	int fileSize = fileInode.size0 << 16 | fileInode.size1;
+/***********************************************************************
+ Extent-mapped files (initfs -e):
+	A run of physically contiguous blocks is stored as one (start, length)
+	extent. The first INODE_EXTENTS extents are kept in addr[0..9], the
+	rest in a chain of extent blocks starting at addr[10]. The cursor
+	caches the extent of the last lookup, a sequential scan moves to the
+	next extent when it runs past the cached one.
+***********************************************************************/
 
-	logicalBlockNumber = fileSize / BLOCK_SIZE;
-		
-	if(!isLargeFile)
-	{	
-		if(logicalBlockNumber < len(fileInode.addr))
+/* Reads the extent with the given index, returns 0 if the file has no such extent.
+   Extents past the inode are read through the extent block pinned as level 2 */
+int bmapExtentAt(blockmap_t *map,int index,unsigned int *start,unsigned int *length)
+{
+	inode_t *fileInode = map->inode;
+	if(index < INODE_EXTENTS)
+	{
+		*start = fileInode->addr[2*index];
+		*length = fileInode->addr[2*index + 1];
+		return *length != 0;
+	}
+
+	unsigned int k = index - INODE_EXTENTS;
+	extentblock_t *eb;
+	if(map->level[2] == NULL || k < map->extentBase)
+	{
+		// start over from the first extent block
+		if(fileInode->addr[len(fileInode->addr)-1] == 0)
+			return 0;
+		eb = (extentblock_t*)bmapLevel(map,2,fileInode->addr[len(fileInode->addr)-1]);
+		map->extentBase = 0;
+	}
+	else
+		eb = (extentblock_t*)map->level[2]->data;
+
+	while(k >= map->extentBase + EXTENTS_PER_BLOCK)
+	{
+		if(eb->next == 0)
+			return 0;
+		eb = (extentblock_t*)bmapLevel(map,2,eb->next);
+		map->extentBase += EXTENTS_PER_BLOCK;
+	}
+	if(k - map->extentBase >= eb->count)
+		return 0;
+	*start = eb->extents[k - map->extentBase][0];
+	*length = eb->extents[k - map->extentBase][1];
+	return 1;
+}
+
+/* Returns the disk block holding the logical block of an extent-mapped file, 0 if it is not allocated */
+unsigned int bmapExtent(blockmap_t *map,unsigned int logicalBlockNumber)
+{
+	if(map->extentIndex < 0 || logicalBlockNumber < map->extentLogical)
+	{
+		// rewind to the first extent
+		map->extentLogical = 0;
+		map->extentIndex = 0;
+		if(!bmapExtentAt(map,0,&map->extentStart,&map->extentLength))
 		{
-			fileInode.addr[logicalBlockNumber] = blockNumber;
-			lseek(fd,INODE_POSITION(inode_number),SEEK_SET);
-			write(fd,&fileInode,sizeof(fileInode));
+			map->extentIndex = -1;
+			return 0;
 		}
-		else
+	}
+
+	while(logicalBlockNumber >= map->extentLogical + map->extentLength)
+	{
+		unsigned int start, length;
+		if(!bmapExtentAt(map,map->extentIndex + 1,&start,&length))
+			return 0; // past the last extent
+		map->extentIndex++;
+		map->extentLogical += map->extentLength;
+		map->extentStart = start;
+		map->extentLength = length;
+	}
+	if(map->extentStart == 0) // hole
+		return 0;
+	return map->extentStart + (logicalBlockNumber - map->extentLogical);
+}
+
+/* Adds the data block at the end of an extent-mapped file. The last extent grows when
+   the block follows it on disk, otherwise a new extent is started. Block 0 adds a hole,
+   holes are extents starting at block 0 and grow by other holes only.
+   Returns 0 if an extent block could not be allocated */
+int bmapExtentAppend(blockmap_t *map,unsigned int blockNumber)
+{
+	inode_t *fileInode = map->inode;
+	unsigned int start, length;
+
+	if(map->extentTail == -2)
+	{
+		// find the last extent, once per cursor
+		map->extentTail = -1;
+		while(bmapExtentAt(map,map->extentTail + 1,&start,&length))
+			map->extentTail++;
+	}
+	map->extentIndex = -1; // the cached extent may change
+
+	if(map->extentTail >= 0)
+	{
+		bmapExtentAt(map,map->extentTail,&start,&length);
+		if(start == 0 ? blockNumber == 0 : start + length == blockNumber)
 		{
-			makeLargefile(inode_number);
-			isLargeFile = 1;
+			if(map->extentTail < INODE_EXTENTS)
+			{
+				fileInode->addr[2*map->extentTail + 1]++;
+				imarkdirty(fileInode);
+			}
+			else
+			{
+				((extentblock_t*)map->level[2]->data)->extents[map->extentTail - INODE_EXTENTS - map->extentBase][1]++;
+				map->levelDirty[2] = 1;
+			}
+			return 1;
 		}
 	}
-		
-	lseek(fd,INODE_POSITION(inode_number),SEEK_SET);
-	read(fd,&fileInode,sizeof(fileInode));
-	
-	if(isLargeFile)
+
+	int index = map->extentTail + 1;
+	if(index < INODE_EXTENTS)
 	{
-		
-		int singleIndirectionblockNumber = (logicalBlockNumber/NUMBER_OF_BLOCKS_PER_INDIRECTION);
-		
-		DEBUG_LOG("\n\tLarge file additon, logical block %d",logicalBlockNumber);
-		DEBUG_LOG("\n\tSingle Indirection logical block Number: %d",singleIndirectionblockNumber);
+		fileInode->addr[2*index] = blockNumber;
+		fileInode->addr[2*index + 1] = 1;
+		imarkdirty(fileInode);
+		map->extentTail = index;
+		return 1;
+	}
 
-		//First ten blocks are single indirection blocks
-		if(singleIndirectionblockNumber < len(fileInode.addr) -1)
+	extentblock_t *eb;
+	unsigned int k = index - INODE_EXTENTS;
+	if(k == 0 || k - map->extentBase == EXTENTS_PER_BLOCK)
+	{
+		// start a new extent block, linked from the inode or from the last extent block
+		unsigned int newBlock = get_free_block();
+		if(newBlock == 0)
+			return 0;
+		if(k == 0)
 		{
-			
-			singleIndirectionblockNumber = singleIndirectionblockNumber%len(fileInode.addr);
-			//get single indirect block
-			singleIndirectblock_t sib;
-			
-			if(fileInode.addr[singleIndirectionblockNumber] == 0)
-				fileInode.addr[singleIndirectionblockNumber] = get_free_block();
-			
-			DEBUG_LOG("\n\tSingle Indirection block Number: %d",fileInode.addr[singleIndirectionblockNumber]);
-			
-			lseek(fd,BLOCK_POSITION(fileInode.addr[singleIndirectionblockNumber]),SEEK_SET);
-			read(fd,&sib,sizeof(sib));
-			
-			sib.blockNumbers[logicalBlockNumber%NUMBER_OF_BLOCKS_PER_INDIRECTION] = blockNumber;
-			DEBUG_LOG("\n\tAdded block %d inside Single Indirection block Number %d to pos %d",blockNumber,fileInode.addr[singleIndirectionblockNumber],logicalBlockNumber%NUMBER_OF_BLOCKS_PER_INDIRECTION);
-
-			lseek(fd,BLOCK_POSITION(fileInode.addr[singleIndirectionblockNumber]),SEEK_SET);
-			write(fd,&sib,sizeof(sib));
+			fileInode->addr[len(fileInode->addr)-1] = newBlock;
+			imarkdirty(fileInode);
 		}
 		else
 		{
-			//Any logical number greater than 10 will present inside the last position of addr[] in triple indirection
-			singleIndirectionblockNumber = len(fileInode.addr) -1;
-			DEBUG_LOG("\n\tVery Large file additon, logical block %d",logicalBlockNumber);
-			
-			//First level indirection
-			//Intialize block numbers inside the indirection
-			if(fileInode.addr[singleIndirectionblockNumber] == 0)
-				{
-					fileInode.addr[singleIndirectionblockNumber] = get_free_block();
-					lseek(fd,INODE_POSITION(inode_number),SEEK_SET);
-					write(fd,&fileInode,sizeof(fileInode));
-				
-					singleIndirectblock_t sib;
-					for(i=0;i<len(sib.blockNumbers);i++)
-						sib.blockNumbers[i] = 0;
-					
-					lseek(fd,BLOCK_POSITION(fileInode.addr[len(fileInode.addr)-1]),SEEK_SET);
-					write(fd,&sib,sizeof(sib));
+			((extentblock_t*)map->level[2]->data)->next = newBlock;
+			map->levelDirty[2] = 1;
+			map->extentBase += EXTENTS_PER_BLOCK;
+		}
+		bmapRelease(map,2);
+		map->level[2] = getblk(newBlock);
+		clrbuf(map->level[2]);
+	}
+	eb = (extentblock_t*)map->level[2]->data;
+	eb->extents[eb->count][0] = blockNumber;
+	eb->extents[eb->count][1] = 1;
+	eb->count++;
+	map->levelDirty[2] = 1;
+	map->extentTail = index;
+	return 1;
+}
 
-				}
-			
-			DEBUG_LOG("\n\tTriple Indirection block Number: %d",fileInode.addr[singleIndirectionblockNumber]);
-			
-			singleIndirectblock_t sib1;
-			lseek(fd,BLOCK_POSITION(fileInode.addr[len(fileInode.addr)-1]),SEEK_SET);
-			read(fd,&sib1,sizeof(sib1));
- 
-			int remainingBlocks = logicalBlockNumber - (NUMBER_OF_BLOCKS_PER_INDIRECTION * (len(fileInode.addr)-1));
-			DEBUG_LOG("\n\tRemaining blocks  %d",remainingBlocks);
+/* Frees the data blocks and the extent blocks of an extent-mapped file */
+void deleteExtents(inode_t *fileInode)
+{
+	unsigned int i;
+	for(i=0;i<INODE_EXTENTS && fileInode->addr[2*i + 1] != 0;i++)
+		if(fileInode->addr[2*i] != 0) // not a hole
+			free_blocks(fileInode->addr[2*i],fileInode->addr[2*i + 1]);
 
-			
-			
-			int tripleIndirectionLogicalBlockNumber = (remainingBlocks/(NUMBER_OF_BLOCKS_PER_INDIRECTION
-																	*NUMBER_OF_BLOCKS_PER_INDIRECTION));
-			if(tripleIndirectionLogicalBlockNumber > len(sib1.blockNumbers))
-			{
-					printf("MAX File size reached!");
-					return;
-					
-			}
-			//second level indirection
+	unsigned int blockNumber = fileInode->addr[len(fileInode->addr)-1];
+	while(blockNumber != 0)
+	{
+		buf_t *bp = bread(blockNumber);
+		extentblock_t *eb = (extentblock_t*)bp->data;
+		unsigned int next = eb->next;
+		for(i=0;i<eb->count;i++)
+			if(eb->extents[i][0] != 0)
+				free_blocks(eb->extents[i][0],eb->extents[i][1]);
+		brelse(bp);
+		add_to_free_list(blockNumber);
+		blockNumber = next;
+	}
 
-			//Intialize block numbers inside the indirection
-			if(sib1.blockNumbers[tripleIndirectionLogicalBlockNumber]==0)
-			{
-				sib1.blockNumbers[tripleIndirectionLogicalBlockNumber] = get_free_block();
-				
-				singleIndirectblock_t sib;
-				for(i=0;i<len(sib.blockNumbers);i++)
-					sib.blockNumbers[i] = 0;
-					
-				lseek(fd,BLOCK_POSITION(sib1.blockNumbers[tripleIndirectionLogicalBlockNumber]),SEEK_SET);
-				write(fd,&sib,sizeof(sib));
-			}
-			
-			DEBUG_LOG("\n\tDouble Indirection block Number: %d",sib1.blockNumbers[tripleIndirectionLogicalBlockNumber]);
-			
-			int tripleIndirectionBlockNumber = sib1.blockNumbers[tripleIndirectionLogicalBlockNumber];
+	for(i=0;i<len(fileInode->addr);i++)
+		fileInode->addr[i] = 0;
+}
+
+// Frees a block that was pinned by the cursor, its cached copy is dropped without being written
+void bmapFreeLevel(blockmap_t *map,int level,unsigned int blockNumber)
+{
+	map->levelDirty[level] = 0;
+	bmapRelease(map,level);
+	binval(blockNumber);
+	add_to_free_list(blockNumber);
+}
+
+// Frees the extents of an extent-mapped file past its first newBlocks blocks, last extent first
+void bmapExtentTruncate(blockmap_t *map,unsigned int oldBlocks,unsigned int newBlocks)
+{
+	inode_t *fileInode = map->inode;
+	unsigned int start, length;
+	unsigned int total = oldBlocks;
 
+	if(map->extentTail == -2)
+	{
+		map->extentTail = -1;
+		while(bmapExtentAt(map,map->extentTail + 1,&start,&length))
+			map->extentTail++;
+	}
+	map->extentIndex = -1;
 
-			singleIndirectblock_t sib2;
-			lseek(fd,BLOCK_POSITION(tripleIndirectionBlockNumber),SEEK_SET);
-			read(fd,&sib2,sizeof(sib2));
+	while(total > newBlocks && map->extentTail >= 0)
+	{
+		int tail = map->extentTail;
+		bmapExtentAt(map,tail,&start,&length); // pins the extent block of the tail
+		unsigned int keep = (total - length >= newBlocks) ? 0 : newBlocks - (total - length);
+		if(start != 0) // not a hole
+			free_blocks(start + keep,length - keep);
+		total -= length - keep;
+
+		if(tail < INODE_EXTENTS)
+		{
+			fileInode->addr[2*tail + 1] = keep;
+			if(keep == 0)
+				fileInode->addr[2*tail] = 0;
+			imarkdirty(fileInode);
+		}
+		else
+		{
+			extentblock_t *eb = (extentblock_t*)map->level[2]->data;
+			eb->extents[tail - INODE_EXTENTS - map->extentBase][1] = keep;
+			map->levelDirty[2] = 1;
+			if(keep == 0 && --eb->count == 0)
+			{
+				// last extent of the block, unlink the block
+				bmapFreeLevel(map,2,map->level[2]->blkno);
+				if(tail - INODE_EXTENTS == 0)
+				{
+					fileInode->addr[len(fileInode->addr)-1] = 0;
+					imarkdirty(fileInode);
+				}
+				else
+				{
+					bmapExtentAt(map,tail - 1,&start,&length); // pins the previous extent block
+					((extentblock_t*)map->level[2]->data)->next = 0;
+					map->levelDirty[2] = 1;
+				}
+			}
+		}
+		if(keep != 0)
+			break;
+		map->extentTail--;
+	}
+}
 
+/* Frees the logical blocks newBlocks..oldBlocks-1 at the end of the file, last one first,
+   together with the indirection blocks left empty */
+void bmapTruncate(blockmap_t *map,int oldBlocks,int newBlocks)
+{
+	inode_t *fileInode = map->inode;
+	short isLargeFile = ((fileInode->flags & (1 << 12)) >> 12);
+	int logicalBlockNumber;
+	unsigned int *entries;
 
-			
-			int doubleIndirectionLogicalBlockNumber = (remainingBlocks/NUMBER_OF_BLOCKS_PER_INDIRECTION);
-			DEBUG_LOG("\n\t Double Indirection logical block Number: %d",doubleIndirectionLogicalBlockNumber);
-			
+	if(fileInode->flags & (1 << 13)) // inline data, no blocks
+		return;
 
-			//third level indirection
+	if(fileInode->flags & (1 << 11)) // extent-mapped
+	{
+		bmapExtentTruncate(map,oldBlocks,newBlocks);
+		return;
+	}
 
-			//Intialize block numbers inside the indirection
-			if(sib2.blockNumbers[doubleIndirectionLogicalBlockNumber]==0)
+	for(logicalBlockNumber = oldBlocks - 1; logicalBlockNumber >= newBlocks; logicalBlockNumber--)
+	{
+		if(!isLargeFile)
+		{
+			if(logicalBlockNumber < len(fileInode->addr) && fileInode->addr[logicalBlockNumber] != 0)
 			{
-				sib2.blockNumbers[doubleIndirectionLogicalBlockNumber] = get_free_block();
-				
-				singleIndirectblock_t sib;
-				
-				for(i=0;i<len(sib.blockNumbers);i++)
-					sib.blockNumbers[i] = 0;
-					
-				lseek(fd,BLOCK_POSITION(sib2.blockNumbers[doubleIndirectionLogicalBlockNumber]),SEEK_SET);
-				write(fd,&sib,sizeof(sib));
-
+				add_to_free_list(fileInode->addr[logicalBlockNumber]);
+				fileInode->addr[logicalBlockNumber] = 0;
 			}
-		
-			int doubleIndirectionBlockNumber = sib2.blockNumbers[doubleIndirectionLogicalBlockNumber];
-			DEBUG_LOG("\n\tSingle Indirection block Number: %d",doubleIndirectionBlockNumber);
-			
-			singleIndirectblock_t sib3;
-			lseek(fd,BLOCK_POSITION(doubleIndirectionBlockNumber),SEEK_SET);
-			read(fd,&sib3,sizeof(sib3));
+			continue;
+		}
 
-			
-			int singleIndirectionBlockNumber = (remainingBlocks%NUMBER_OF_BLOCKS_PER_INDIRECTION);
+		int singleIndirectionblockNumber = (logicalBlockNumber/NUMBER_OF_BLOCKS_PER_INDIRECTION);
+		int index = logicalBlockNumber % NUMBER_OF_BLOCKS_PER_INDIRECTION;
 
-			if(sib3.blockNumbers[singleIndirectionBlockNumber]==0)
-				sib3.blockNumbers[singleIndirectionBlockNumber] = blockNumber;
-		
-			DEBUG_LOG("\n\tAdded %d to block Number: %d at position %d",blockNumber,doubleIndirectionBlockNumber,singleIndirectionBlockNumber);
-			
-			lseek(fd,BLOCK_POSITION(doubleIndirectionBlockNumber),SEEK_SET);
-			write(fd,&sib3,sizeof(sib3));
+		if(singleIndirectionblockNumber < len(fileInode->addr) - 1)
+		{
+			unsigned int indirectBlock = fileInode->addr[singleIndirectionblockNumber];
+			if(indirectBlock == 0)
+				continue;
+			entries = bmapLevel(map,2,indirectBlock);
+			if(entries[index] != 0)
+			{
+				add_to_free_list(entries[index]);
+				entries[index] = 0;
+				map->levelDirty[2] = 1;
+			}
+			if(index == 0) // the indirection block is empty
+			{
+				bmapFreeLevel(map,2,indirectBlock);
+				fileInode->addr[singleIndirectionblockNumber] = 0;
+			}
+			continue;
+		}
 
-			lseek(fd,BLOCK_POSITION(tripleIndirectionBlockNumber),SEEK_SET);
-			write(fd,&sib2,sizeof(sib2));
+		// triple indirection, addr[10] -> first level -> second level -> third level -> data block
+		int remainingBlocks = logicalBlockNumber - (NUMBER_OF_BLOCKS_PER_INDIRECTION * (len(fileInode->addr)-1));
+		int first = remainingBlocks/(NUMBER_OF_BLOCKS_PER_INDIRECTION*NUMBER_OF_BLOCKS_PER_INDIRECTION);
+		int second = (remainingBlocks/NUMBER_OF_BLOCKS_PER_INDIRECTION)%NUMBER_OF_BLOCKS_PER_INDIRECTION;
+		unsigned int levelBlock[3];
 
-			lseek(fd,BLOCK_POSITION(fileInode.addr[len(fileInode.addr) - 1]),SEEK_SET);
-			write(fd,&sib1,sizeof(sib1));
- 
+		if((levelBlock[0] = fileInode->addr[len(fileInode->addr)-1]) == 0)
+			continue;
+		if((levelBlock[1] = bmapLevel(map,0,levelBlock[0])[first]) == 0)
+			continue;
+		if((levelBlock[2] = bmapLevel(map,1,levelBlock[1])[second]) == 0)
+			continue;
+		entries = bmapLevel(map,2,levelBlock[2]);
+		if(entries[index] != 0)
+		{
+			add_to_free_list(entries[index]);
+			entries[index] = 0;
+			map->levelDirty[2] = 1;
 		}
+		if(index != 0)
+			continue;
+
+		// free the indirection blocks emptied by this block, from the third level up
+		bmapFreeLevel(map,2,levelBlock[2]);
+		bmapLevel(map,1,levelBlock[1])[second] = 0;
+		map->levelDirty[1] = 1;
+		if(second != 0)
+			continue;
+		bmapFreeLevel(map,1,levelBlock[1]);
+		bmapLevel(map,0,levelBlock[0])[first] = 0;
+		map->levelDirty[0] = 1;
+		if(first != 0)
+			continue;
+		bmapFreeLevel(map,0,levelBlock[0]);
+		fileInode->addr[len(fileInode->addr)-1] = 0;
 	}
+	imarkdirty(fileInode);
+}
 
-	lseek(fd,INODE_POSITION(inode_number),SEEK_SET);
-	write(fd,&fileInode,sizeof(fileInode));
+//Gets the block from file-inode based on the offset
+int getBlockToRead(unsigned long long offset,int inode_number)
+{
+	blockmap_t map;
+	bmapOpen(&map,inode_number);
+	int blockNumber = bmap(&map,offset/BLOCK_SIZE);
+	bmapClose(&map);
+	return blockNumber;
+}
 
+//Adds the block to the file inode at the given logical block number (the end of the file)
+void addDataBlockToInode(int inode_number,int logicalBlockNumber,int blockNumber)
+{
+	blockmap_t map;
+	bmapOpen(&map,inode_number);
+	bmapAppend(&map,logicalBlockNumber,blockNumber);
+	bmapClose(&map);
 }
 
 
@@ -1900,7 +5166,8 @@ void addDataBlockToInode(int inode_number,int blockNumber)
 void print_free_inode_list()
 {
 	int i = 0,count =0;
-	int freeinodelist[(numberOfInodes)-1];
+	int capacity = esb.freeInodes + 1;
+	int *freeinodelist = malloc(sizeof(int) * capacity); // on the heap, the list can be large
 	i = get_free_inode();
 	
 	printf("\nList of free inodes:");
@@ -1910,22 +5177,21 @@ void print_free_inode_list()
 	while(i!=0){
 		printf("\n%d",i);
 		freeinodelist[count]=i;
-		lseek(fd,INODE_POSITION(i),SEEK_SET);
-
-		read(fd,&tempinode,sizeof(tempinode));
+		readInode(i,&tempinode);
 		tempinode.flags = tempinode.flags | (1 << 15); // set allocation
 		
-		lseek(fd,INODE_POSITION(i),SEEK_SET);
-		write(fd,&tempinode,sizeof(tempinode));
+		writeInode(i,&tempinode);
 
+		if(++count == capacity)
+			break;
 		i = get_free_inode();
-		count++;
 	}
 
 	for(i=0;i<count;i++)
 	{		
 		add_free_inode(freeinodelist[i]);
 	}
+	free(freeinodelist);
 
 	printf("\nTotal number of free inodes: %d",count);
 }
@@ -1934,7 +5200,8 @@ void print_free_inode_list()
 void print_free_block_list()
 {
 	int i = 0,count =0;
-	int freeDBlockList[sb.fsize];
+	int capacity = esb.freeBlocks + 1;
+	int *freeDBlockList = malloc(sizeof(int) * capacity); // on the heap, the list can be large
 
 	printf("\nList of free data Blocks:");
 
@@ -1944,14 +5211,16 @@ void print_free_block_list()
 	{
 		printf("\n%d",d);
 		freeDBlockList[count] = d;
+		if(++count == capacity)
+			break;
 		d = get_free_block();
-			count++;
 	}
 	printf("\nTotal number of free Data blocks: %d",count);
 	 for(i=0;i<count;i++)
 	 {
 	 	add_to_free_list(freeDBlockList[i]);
 	 }
+	 free(freeDBlockList);
 }
 
 /***********************************************************
@@ -1973,8 +5242,7 @@ int searchFileInFileSystem(char *path, int *parent_inode_number,char *fileName)
 		if(new_inode = fileExists(dirName,*parent_inode_number)) // If directory already exists
 		{
 			// Check if it is a directory
-			lseek(fd,INODE_POSITION(new_inode),SEEK_SET);
-			read(fd,&currentInode,sizeof(currentInode));
+			readInode(new_inode,&currentInode);
 			short isDirectory = ((currentInode.flags & (1 << 14)) >> 14); // 2nd bit
 			
 			if(isDirectory)
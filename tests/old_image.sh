@@ -0,0 +1,29 @@
+#!/bin/sh
+# Loads an image without an extended super block (as written before the free
+# counts were kept) and checks that df counts its free blocks and inodes.
+# usage: tests/old_image.sh [path to fsaccess binary], run from the repository root
+set -e
+BIN=${1:-./fsaccess}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+head -c 50000 /dev/urandom > "$DIR/data"
+touch "$DIR/disk"
+printf 'initfs %s/disk 8000 300\ncpin %s/data d\nmkdir /a\ndf\nq\n' "$DIR" "$DIR" | "$BIN" > "$DIR/new.txt"
+
+# block 0 of an old image is zero
+dd if=/dev/zero of="$DIR/disk" bs=1024 count=1 conv=notrunc 2> /dev/null
+
+printf 'load %s/disk\ndf\nq\n' "$DIR" | "$BIN" > "$DIR/old.txt"
+printf 'load %s/disk\nrm d\ndf\nq\n' "$DIR" | "$BIN" > "$DIR/rm.txt"
+printf 'load %s/disk\ndf\nq\n' "$DIR" | "$BIN" > "$DIR/saved.txt"
+
+counts() { grep -E -o '(Blocks|Inodes): .*' "$1"; }
+if [ "$(counts "$DIR/new.txt")" != "$(counts "$DIR/old.txt")" ]; then
+	echo "FAIL: free counts of the old image differ"; counts "$DIR/new.txt"; counts "$DIR/old.txt"; exit 1
+fi
+if ! counts "$DIR/rm.txt" | grep -q "Inodes: 304 total, 2 used, 302 free" \
+	|| [ "$(counts "$DIR/rm.txt")" != "$(counts "$DIR/saved.txt")" ]; then
+	echo "FAIL: free counts after rm"; counts "$DIR/rm.txt"; counts "$DIR/saved.txt"; exit 1
+fi
+echo PASS